@@ -2,14 +2,42 @@
  * Simple sound playback using ALSA API and libasound.
  *
  * Compile:
- * $ cc -o play sound_playback.c -lasound
+ * $ cc -o play sound_playback.c -lasound -lpthread
  * 
  * Usage:
- * $ ./play <sample_rate> <channels> <seconds> < <file>
+ * $ ./play [options] <sample_rate> <channels> <seconds> < <file>
+ *
+ * Options:
+ *   --mmap             write through the mmap'd DMA area
+ *   --bench            play silence and report timing as key=value lines
+ *   --buffer=FRAMES    request this buffer size
+ *   --period=FRAMES    request this period size
+ *   --fifo=PRIO        run the playback loop with SCHED_FIFO priority PRIO
+ *   --mlock            lock all memory (mlockall)
+ *   --load=THREADS     spin THREADS busy threads as synthetic CPU load
+ *   --load-duty=PCT    busy percentage of each load thread (default 100)
+ *   --file=PATH        play PATH through a memory mapping instead of stdin
+ *   --prefetch=PERIODS periods buffered ahead of playback (default 16)
  * 
  * Examples:
  * $ ./play 44100 2 5 < /dev/urandom
  * $ ./play 22050 1 8 < /path/to/file.wav
+ * $ ./play --mmap 44100 2 5 < /dev/urandom
+ *
+ * Input never blocks the playback loop: stdin is drained by a reader
+ * thread into a lock-free single-producer/single-consumer ring holding
+ * --prefetch periods, and playback starts once that ring is full. With
+ * --file the input is mmap'd and prefaulted up front instead.
+ *
+ * With --mmap the input is copied straight into the driver's DMA area
+ * (snd_pcm_mmap_begin/commit) and the player sleeps in poll() between
+ * periods, instead of going through a buffer with snd_pcm_writei().
+ *
+ * --bench does not read stdin: it writes silence with snd_pcm_writei()
+ * and, at the end, prints xruns, wakeups per second (voluntary context
+ * switches), per-period write latency percentiles and CPU time, e.g.
+ * $ ./play --bench --period=256 --buffer=1024 --fifo=80 --mlock \
+ *          --load=4 --load-duty=50 48000 2 30
  *
  * Copyright (C) 2009 Alessandro Ghedini <alessandro@ghedini.me>
  * --------------------------------------------------------------
@@ -23,27 +51,471 @@
 
 #include <alsa/asoundlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #define PCM_DEVICE "default"
 
+/******** Input ********/
+
+/*
+ * SPSC byte ring between the reader thread (producer, owns head) and
+ * the playback loop (consumer, owns tail). size is a power of two and
+ * head/tail run freely; each side publishes its index with a release
+ * store and reads the other's with an acquire load.
+ */
+struct prefetch_ring {
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	int eof;
+};
+
+static struct prefetch_ring ring;
+
+/* --file input */
+static const char *file_map;
+static size_t file_len, file_pos;
+
+static void nap_us(long us)
+{
+	struct timespec ts = { 0, us * 1000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static void *reader_thread(void *arg)
+{
+	size_t head, tail, space, off;
+	ssize_t n;
+
+	for (;;) {
+		head = ring.head;
+		tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+		space = ring.size - (head - tail);
+		if (!space) {
+			nap_us(1000);
+			continue;
+		}
+
+		off = head & (ring.size - 1);
+		if (space > ring.size - off)
+			space = ring.size - off;
+
+		n = read(0, ring.buf + off, space);
+		if (n <= 0)
+			break;
+		__atomic_store_n(&ring.head, head + n, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&ring.eof, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int input_open(const char *path, size_t prefetch_bytes)
+{
+	struct stat st;
+	pthread_t tid;
+	int fd;
+
+	if (path) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			perror(path);
+			return -1;
+		}
+		file_len = st.st_size;
+		file_map = mmap(NULL, file_len, PROT_READ,
+				MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		close(fd);
+		if (file_map == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		madvise((void *)file_map, file_len, MADV_SEQUENTIAL);
+		return 0;
+	}
+
+	for (ring.size = 4096; ring.size < prefetch_bytes; ring.size <<= 1)
+		;
+	ring.buf = malloc(ring.size);
+	if (!ring.buf)
+		return -1;
+	if (pthread_create(&tid, NULL, reader_thread, NULL))
+		return -1;
+
+	/* start with a full ring so the first periods never wait on input */
+	while (!__atomic_load_n(&ring.eof, __ATOMIC_ACQUIRE) &&
+	       __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) < ring.size)
+		nap_us(1000);
+
+	return 0;
+}
+
+/*
+ * Take len bytes of input for the playback loop, zero-filling whatever
+ * the input could not supply. Returns the bytes of real input, 0 at
+ * end of input.
+ */
+static size_t input_read(char *buf, size_t len)
+{
+	size_t done = 0, head, n, off;
+	int eof;
+
+	if (file_map) {
+		done = file_len - file_pos < len ? file_len - file_pos : len;
+		memcpy(buf, file_map + file_pos, done);
+		file_pos += done;
+	} else {
+		while (done < len) {
+			eof = __atomic_load_n(&ring.eof, __ATOMIC_ACQUIRE);
+			head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+			if (head == ring.tail) {
+				if (eof)
+					break;
+				/* the reader fell behind: the ring ran dry */
+				nap_us(100);
+				continue;
+			}
+
+			n = head - ring.tail;
+			off = ring.tail & (ring.size - 1);
+			if (n > ring.size - off)
+				n = ring.size - off;
+			if (n > len - done)
+				n = len - done;
+			memcpy(buf + done, ring.buf + off, n);
+			done += n;
+			__atomic_store_n(&ring.tail, ring.tail + n,
+					 __ATOMIC_RELEASE);
+		}
+	}
+
+	memset(buf + done, 0, len - done);
+	return done;
+}
+
+static int xrun_recover(snd_pcm_t *pcm_handle, int err)
+{
+	if (err == -EPIPE) {
+		printf("XRUN.\n");
+		return snd_pcm_prepare(pcm_handle);
+	}
+	if (err == -ESTRPIPE) {
+		while ((err = snd_pcm_resume(pcm_handle)) == -EAGAIN)
+			sleep(1);
+		if (err < 0)
+			return snd_pcm_prepare(pcm_handle);
+		return 0;
+	}
+
+	return err;
+}
+
+/*
+ * Fill the ring in place: map the writable part of the DMA area, copy
+ * input directly into it and commit. Sleep in poll() until at least a
+ * period is free again.
+ */
+static int play_mmap(snd_pcm_t *pcm_handle, unsigned int channels,
+		     snd_pcm_uframes_t period, snd_pcm_uframes_t total)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames, size;
+	snd_pcm_sframes_t avail, committed;
+	size_t frame_bytes = channels * 2 /* 2 -> sample size */;
+	struct pollfd *ufds;
+	unsigned short revents;
+	size_t got;
+	char *ptr;
+	int count, err, eof = 0;
+
+	count = snd_pcm_poll_descriptors_count(pcm_handle);
+	if (count <= 0)
+		return -EINVAL;
+	ufds = malloc(sizeof(*ufds) * count);
+	snd_pcm_poll_descriptors(pcm_handle, ufds, count);
+
+	while (total > 0 && !eof) {
+		avail = snd_pcm_avail_update(pcm_handle);
+		if (avail < 0) {
+			if ((err = xrun_recover(pcm_handle, avail)) < 0)
+				goto out;
+			continue;
+		}
+
+		if ((snd_pcm_uframes_t)avail < period) {
+			/* ring full: start playing if not yet, then wait */
+			if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED &&
+			    (err = snd_pcm_start(pcm_handle)) < 0)
+				goto out;
+
+			if (poll(ufds, count, -1) < 0) {
+				err = -errno;
+				goto out;
+			}
+			snd_pcm_poll_descriptors_revents(pcm_handle, ufds, count,
+							 &revents);
+			if (revents & POLLERR) {
+				err = snd_pcm_state(pcm_handle) == SND_PCM_STATE_XRUN ?
+				      -EPIPE : -ESTRPIPE;
+				if ((err = xrun_recover(pcm_handle, err)) < 0)
+					goto out;
+			}
+			continue;
+		}
+
+		size = period < total ? period : total;
+		while (size > 0) {
+			frames = size;
+			err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset,
+						 &frames);
+			if (err < 0) {
+				if ((err = xrun_recover(pcm_handle, err)) < 0)
+					goto out;
+				break;
+			}
+
+			/* interleaved: one area describes every channel */
+			ptr = (char *)areas[0].addr +
+			      (areas[0].first + offset * areas[0].step) / 8;
+			got = input_read(ptr, frames * frame_bytes);
+			if (got < frames * frame_bytes) {
+				printf("Early end of file.\n");
+				eof = 1;
+			}
+
+			committed = snd_pcm_mmap_commit(pcm_handle, offset,
+							frames);
+			if (committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+				err = committed < 0 ? committed : -EPIPE;
+				if ((err = xrun_recover(pcm_handle, err)) < 0)
+					goto out;
+				break;
+			}
+			size -= frames;
+			total -= frames;
+			if (eof)
+				break;
+		}
+	}
+
+	/* a short file may never have filled the ring */
+	if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(pcm_handle);
+	err = 0;
+out:
+	free(ufds);
+	return err;
+}
+
+/******** Benchmark ********/
+
+static int load_duty = 100;
+
+/* burn CPU for load_duty percent of every 10 ms */
+static void *load_thread(void *arg)
+{
+	struct timespec t0, now, idle;
+	long busy_ns = load_duty * 100000L;
+
+	idle.tv_sec = 0;
+	idle.tv_nsec = 10000000L - busy_ns;
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while ((now.tv_sec - t0.tv_sec) * 1000000000L +
+			 (now.tv_nsec - t0.tv_nsec) < busy_ns);
+		if (idle.tv_nsec > 0)
+			nanosleep(&idle, NULL);
+	}
+
+	return NULL;
+}
+
+static long long ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static long long tv_us(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static long long percentile(const long long *sorted, int n, double p)
+{
+	int i = (int)(p / 100.0 * (n - 1) + 0.5);
+
+	return n ? sorted[i] : 0;
+}
+
+/*
+ * Write silence one period at a time for the whole run, timing each
+ * snd_pcm_writei() call. I/O never enters the loop, so what is measured
+ * is the driver and the scheduler.
+ */
+static int run_bench(snd_pcm_t *pcm_handle, unsigned int channels,
+		     snd_pcm_uframes_t period, unsigned int rate, int seconds)
+{
+	struct timespec t0, t1, start, end;
+	struct rusage ru0, ru1;
+	long long *lat, wall_ns, cpu_us;
+	long xruns = 0, errors = 0, wakeups;
+	int loops, n = 0;
+	snd_pcm_sframes_t ret;
+	char *buff;
+
+	loops = (long long)seconds * rate / period;
+	lat = calloc(loops, sizeof(*lat));
+	buff = calloc(period, channels * 2 /* 2 -> sample size */);
+	if (!lat || !buff)
+		return -ENOMEM;
+
+	getrusage(RUSAGE_SELF, &ru0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (n < loops) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		ret = snd_pcm_writei(pcm_handle, buff, period);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		if (ret == -EPIPE) {
+			xruns++;
+			snd_pcm_prepare(pcm_handle);
+			continue;
+		} else if (ret < 0) {
+			errors++;
+			if (snd_pcm_recover(pcm_handle, ret, 1) < 0)
+				break;
+			continue;
+		}
+		lat[n++] = ts_ns(&t1) - ts_ns(&t0);
+	}
+
+	snd_pcm_drain(pcm_handle);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &ru1);
+
+	wall_ns = ts_ns(&end) - ts_ns(&start);
+	wakeups = ru1.ru_nvcsw - ru0.ru_nvcsw;
+	cpu_us = tv_us(&ru1.ru_utime) - tv_us(&ru0.ru_utime) +
+		 tv_us(&ru1.ru_stime) - tv_us(&ru0.ru_stime);
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+
+	printf("periods=%d\n", n);
+	printf("period_frames=%lu\n", (unsigned long)period);
+	printf("xruns=%ld\n", xruns);
+	printf("errors=%ld\n", errors);
+	printf("wall_ms=%lld\n", wall_ns / 1000000);
+	printf("wakeups_per_sec=%.1f\n",
+	       wall_ns ? wakeups * 1e9 / wall_ns : 0.0);
+	printf("write_ns_p50=%lld\n", percentile(lat, n, 50));
+	printf("write_ns_p90=%lld\n", percentile(lat, n, 90));
+	printf("write_ns_p99=%lld\n", percentile(lat, n, 99));
+	printf("write_ns_p999=%lld\n", percentile(lat, n, 99.9));
+	printf("write_ns_max=%lld\n", n ? lat[n - 1] : 0);
+	printf("cpu_user_us=%lld\n",
+	       tv_us(&ru1.ru_utime) - tv_us(&ru0.ru_utime));
+	printf("cpu_sys_us=%lld\n",
+	       tv_us(&ru1.ru_stime) - tv_us(&ru0.ru_stime));
+	printf("cpu_pct=%.2f\n",
+	       wall_ns ? cpu_us * 1e5 / wall_ns : 0.0);
+
+	free(buff);
+	free(lat);
+	return 0;
+}
+
+static const struct option long_opts[] = {
+	{ "mmap",	no_argument,		NULL, 'm' },
+	{ "bench",	no_argument,		NULL, 'b' },
+	{ "buffer",	required_argument,	NULL, 'B' },
+	{ "period",	required_argument,	NULL, 'P' },
+	{ "fifo",	required_argument,	NULL, 'f' },
+	{ "mlock",	no_argument,		NULL, 'l' },
+	{ "load",	required_argument,	NULL, 'L' },
+	{ "load-duty",	required_argument,	NULL, 'd' },
+	{ "file",	required_argument,	NULL, 'F' },
+	{ "prefetch",	required_argument,	NULL, 'p' },
+	{ NULL,		0,			NULL, 0 },
+};
+
 int main(int argc, char **argv) {
-	unsigned int pcm, tmp, dir;
+	int pcm, err;
+	unsigned int tmp, dir;
 	int rate, channels, seconds;
 	snd_pcm_t *pcm_handle;
 	snd_pcm_hw_params_t *params;
 	snd_pcm_uframes_t frames;
 	char *buff;
 	int buff_size, loops;
+	int use_mmap = 0, bench = 0, fifo_prio = 0, lock_mem = 0;
+	int load_threads = 0, prefetch = 16;
+	const char *input_path = NULL;
+	snd_pcm_uframes_t buffer_req = 0, period_req = 0;
+	struct sched_param sp;
+	pthread_t tid;
+	int c;
 
-	if (argc < 4) {
-		printf("Usage: %s <sample_rate> <channels> <seconds>\n",
+	while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'm': use_mmap = 1; break;
+		case 'b': bench = 1; break;
+		case 'B': buffer_req = strtoul(optarg, NULL, 0); break;
+		case 'P': period_req = strtoul(optarg, NULL, 0); break;
+		case 'f': fifo_prio = atoi(optarg); break;
+		case 'l': lock_mem = 1; break;
+		case 'L': load_threads = atoi(optarg); break;
+		case 'd': load_duty = atoi(optarg); break;
+		case 'F': input_path = optarg; break;
+		case 'p': prefetch = atoi(optarg); break;
+		default:
+			return -1;
+		}
+	}
+
+	if (argc - optind < 3) {
+		printf("Usage: %s [options] <sample_rate> <channels> <seconds>\n",
 								argv[0]);
 		return -1;
 	}
 
-	rate 	 = atoi(argv[1]);
-	channels = atoi(argv[2]);
-	seconds  = atoi(argv[3]);
+	rate 	 = atoi(argv[optind]);
+	channels = atoi(argv[optind + 1]);
+	seconds  = atoi(argv[optind + 2]);
+
+	if (load_duty < 1 || load_duty > 100)
+		load_duty = 100;
+	for (c = 0; c < load_threads; c++)
+		pthread_create(&tid, NULL, load_thread, NULL);
+
+	if (lock_mem && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		perror("mlockall");
+
+	if (fifo_prio > 0) {
+		sp.sched_priority = fifo_prio;
+		if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+			perror("sched_setscheduler");
+	}
 
 	/* Open the PCM device in playback mode */
 	if (pcm = snd_pcm_open(&pcm_handle, PCM_DEVICE,
@@ -58,6 +530,7 @@ int main(int argc, char **argv) {
 
 	/* Set parameters */
 	if (pcm = snd_pcm_hw_params_set_access(pcm_handle, params,
+					use_mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED :
 					SND_PCM_ACCESS_RW_INTERLEAVED) < 0) 
 		printf("ERROR: Can't set interleaved mode. %s\n", snd_strerror(pcm));
 
@@ -71,6 +544,14 @@ int main(int argc, char **argv) {
 	if (pcm = snd_pcm_hw_params_set_rate_near(pcm_handle, params, &rate, 0) < 0) 
 		printf("ERROR: Can't set rate. %s\n", snd_strerror(pcm));
 
+	if (period_req && (pcm = snd_pcm_hw_params_set_period_size_near(
+				pcm_handle, params, &period_req, 0)) < 0)
+		printf("ERROR: Can't set period size. %s\n", snd_strerror(pcm));
+
+	if (buffer_req && (pcm = snd_pcm_hw_params_set_buffer_size_near(
+				pcm_handle, params, &buffer_req)) < 0)
+		printf("ERROR: Can't set buffer size. %s\n", snd_strerror(pcm));
+
 	/* Write parameters */
 	if (pcm = snd_pcm_hw_params(pcm_handle, params) < 0)
 		printf("ERROR: Can't set harware parameters. %s\n", snd_strerror(pcm));
@@ -93,9 +574,38 @@ int main(int argc, char **argv) {
 
 	printf("seconds: %d\n", seconds);	
 
-	/* Allocate buffer to hold single period */
 	snd_pcm_hw_params_get_period_size(params, &frames, 0);
 
+	if (!bench && input_open(input_path, (size_t)(prefetch > 1 ? prefetch : 2) *
+				 frames * channels * 2 /* 2 -> sample size */) < 0) {
+		snd_pcm_close(pcm_handle);
+		return -1;
+	}
+
+	if (bench) {
+		snd_pcm_hw_params_get_rate(params, &tmp, 0);
+		if ((err = run_bench(pcm_handle, channels, frames, tmp,
+				     seconds)) < 0)
+			printf("ERROR. benchmark failed. %s\n",
+			       snd_strerror(err));
+		snd_pcm_close(pcm_handle);
+		return err < 0 ? -1 : 0;
+	}
+
+	if (use_mmap) {
+		snd_pcm_hw_params_get_rate(params, &tmp, 0);
+		if ((err = play_mmap(pcm_handle, channels, frames,
+				     (snd_pcm_uframes_t)seconds * tmp)) < 0)
+			printf("ERROR. mmap playback failed. %s\n",
+			       snd_strerror(err));
+		else
+			snd_pcm_drain(pcm_handle);
+		snd_pcm_close(pcm_handle);
+		return err < 0 ? -1 : 0;
+	}
+
+	/* Allocate buffer to hold single period */
+
 	buff_size = frames * channels * 2 /* 2 -> sample size */;
 	buff = (char *) malloc(buff_size);
 
@@ -103,7 +613,7 @@ int main(int argc, char **argv) {
 
 	for (loops = (seconds * 1000000) / tmp; loops > 0; loops--) {
 
-		if (pcm = read(0, buff, buff_size) == 0) {
+		if (pcm = input_read(buff, buff_size) == 0) {
 			printf("Early end of file.\n");
 			return 0;
 		}
@@ -0,0 +1,242 @@
+/*
+ * Concurrent multi-stream load generator for the PCM driver.
+ *
+ * Opens N playback and M capture streams on one device, each driven by
+ * its own thread, and reports per-stream xruns and wakeup jitter plus
+ * the aggregate frame rate.
+ *
+ * Compile:
+ * $ cc -o pcm_load pcm_load.c -lasound -lpthread
+ *
+ * Usage:
+ * $ ./pcm_load [-D device] [-p playback] [-c capture] [-f format]
+ *              [-r rate] [-n channels] [-P period] [-b periods] [-t seconds]
+ *
+ * Examples:
+ * $ ./pcm_load -D hw:0 -p 4 -c 1 -t 10
+ * $ ./pcm_load -D hw:0 -p 16 -f S32_LE -r 96000 -P 256 -b 4
+ *
+ * Jitter is the deviation of the time between two consecutive returns
+ * of snd_pcm_writei()/snd_pcm_readi() from the nominal period time.
+ */
+
+#include <alsa/asoundlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_STREAMS	64
+
+struct stream {
+	pthread_t tid;
+	int index;
+	snd_pcm_stream_t dir;
+	snd_pcm_t *pcm;
+	snd_pcm_uframes_t period;
+	unsigned int rate;
+	int err;
+	/* results */
+	unsigned long long frames;
+	long xruns;
+	long long jitter_ns_max;
+	long long jitter_ns_total;
+	long wakeups;
+};
+
+static const char *device = "default";
+static snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+static unsigned int rate = 48000;
+static unsigned int channels = 2;
+static snd_pcm_uframes_t period = 1024;
+static unsigned int periods = 4;
+static int seconds = 10;
+
+static pthread_barrier_t start_barrier;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int stream_setup(struct stream *st)
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_uframes_t buffer = period * periods;
+	int err;
+
+	err = snd_pcm_open(&st->pcm, device, st->dir, 0);
+	if (err < 0)
+		return err;
+
+	snd_pcm_hw_params_alloca(&params);
+	snd_pcm_hw_params_any(st->pcm, params);
+
+	if ((err = snd_pcm_hw_params_set_access(st->pcm, params,
+				SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+	    (err = snd_pcm_hw_params_set_format(st->pcm, params, format)) < 0 ||
+	    (err = snd_pcm_hw_params_set_channels(st->pcm, params,
+						  channels)) < 0)
+		return err;
+
+	st->rate = rate;
+	st->period = period;
+	if ((err = snd_pcm_hw_params_set_rate_near(st->pcm, params,
+						   &st->rate, 0)) < 0 ||
+	    (err = snd_pcm_hw_params_set_period_size_near(st->pcm, params,
+						&st->period, 0)) < 0 ||
+	    (err = snd_pcm_hw_params_set_buffer_size_near(st->pcm, params,
+							  &buffer)) < 0)
+		return err;
+
+	if ((err = snd_pcm_hw_params(st->pcm, params)) < 0)
+		return err;
+
+	snd_pcm_hw_params_get_period_size(params, &st->period, 0);
+	return snd_pcm_prepare(st->pcm);
+}
+
+static void *stream_thread(void *arg)
+{
+	struct stream *st = arg;
+	long long period_ns, t, last = 0, dev, end;
+	snd_pcm_sframes_t n;
+	char *buff;
+
+	buff = calloc(st->period, snd_pcm_frames_to_bytes(st->pcm, 1));
+	period_ns = st->period * 1000000000LL / st->rate;
+
+	pthread_barrier_wait(&start_barrier);
+	end = now_ns() + seconds * 1000000000LL;
+
+	while (buff && (t = now_ns()) < end) {
+		if (st->dir == SND_PCM_STREAM_PLAYBACK)
+			n = snd_pcm_writei(st->pcm, buff, st->period);
+		else
+			n = snd_pcm_readi(st->pcm, buff, st->period);
+
+		if (n == -EPIPE) {
+			st->xruns++;
+			snd_pcm_prepare(st->pcm);
+			last = 0;
+			continue;
+		} else if (n < 0) {
+			if (snd_pcm_recover(st->pcm, n, 1) < 0) {
+				st->err = n;
+				break;
+			}
+			last = 0;
+			continue;
+		}
+		st->frames += n;
+
+		/* the first writes only fill the buffer and do not block */
+		t = now_ns();
+		if (last && snd_pcm_state(st->pcm) == SND_PCM_STATE_RUNNING) {
+			dev = t - last - period_ns;
+			if (dev < 0)
+				dev = -dev;
+			if (dev > st->jitter_ns_max)
+				st->jitter_ns_max = dev;
+			st->jitter_ns_total += dev;
+			st->wakeups++;
+		}
+		last = t;
+	}
+
+	if (st->dir == SND_PCM_STREAM_PLAYBACK)
+		snd_pcm_drop(st->pcm);
+	free(buff);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-D device] [-p playback] [-c capture] [-f format]\n"
+	       "       [-r rate] [-n channels] [-P period] [-b periods] [-t seconds]\n",
+	       prog);
+}
+
+int main(int argc, char **argv)
+{
+	static struct stream streams[MAX_STREAMS];
+	int nplay = 1, ncapt = 0, nstreams, i, c, err;
+	unsigned long long total = 0;
+	long long t0, elapsed;
+
+	while ((c = getopt(argc, argv, "D:p:c:f:r:n:P:b:t:h")) != -1) {
+		switch (c) {
+		case 'D': device = optarg; break;
+		case 'p': nplay = atoi(optarg); break;
+		case 'c': ncapt = atoi(optarg); break;
+		case 'f':
+			format = snd_pcm_format_value(optarg);
+			if (format == SND_PCM_FORMAT_UNKNOWN) {
+				printf("ERROR: Unknown format %s.\n", optarg);
+				return -1;
+			}
+			break;
+		case 'r': rate = atoi(optarg); break;
+		case 'n': channels = atoi(optarg); break;
+		case 'P': period = strtoul(optarg, NULL, 0); break;
+		case 'b': periods = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	nstreams = nplay + ncapt;
+	if (nplay < 0 || ncapt < 0 || !nstreams || nstreams > MAX_STREAMS) {
+		printf("ERROR: Between 1 and %d streams in total.\n", MAX_STREAMS);
+		return -1;
+	}
+
+	for (i = 0; i < nstreams; i++) {
+		streams[i].index = i;
+		streams[i].dir = i < nplay ? SND_PCM_STREAM_PLAYBACK :
+					     SND_PCM_STREAM_CAPTURE;
+		err = stream_setup(&streams[i]);
+		if (err < 0) {
+			printf("ERROR: Can't set up %s stream %d. %s\n",
+			       i < nplay ? "playback" : "capture", i,
+			       snd_strerror(err));
+			return -1;
+		}
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, nstreams + 1);
+	for (i = 0; i < nstreams; i++)
+		pthread_create(&streams[i].tid, NULL, stream_thread, &streams[i]);
+
+	pthread_barrier_wait(&start_barrier);
+	t0 = now_ns();
+	for (i = 0; i < nstreams; i++)
+		pthread_join(streams[i].tid, NULL);
+	elapsed = now_ns() - t0;
+
+	printf("%-6s %-8s %7s %12s %6s %14s %14s\n", "stream", "dir", "period",
+	       "frames", "xruns", "jitter_avg_us", "jitter_max_us");
+	for (i = 0; i < nstreams; i++) {
+		struct stream *st = &streams[i];
+
+		printf("%-6d %-8s %7lu %12llu %6ld %14.1f %14.1f%s%s\n", i,
+		       st->dir == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture",
+		       (unsigned long)st->period, st->frames, st->xruns,
+		       st->wakeups ? st->jitter_ns_total / 1e3 / st->wakeups : 0.0,
+		       st->jitter_ns_max / 1e3,
+		       st->err ? " error: " : "",
+		       st->err ? snd_strerror(st->err) : "");
+		total += st->frames;
+		snd_pcm_close(st->pcm);
+	}
+
+	printf("streams=%d aggregate_frames_per_sec=%.0f\n", nstreams,
+	       elapsed ? total * 1e9 / elapsed : 0.0);
+
+	return 0;
+}
@@ -1,26 +1,67 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
 
+/* MT7688 I2S controller window, driven by snd_pi_i2s_pcm backend=i2s */
+#define PI_I2S_BASE	0x10000a00
+#define PI_I2S_SIZE	0x100
+#define PI_I2S_GDMA_TX	4	/* GDMA request line of the TX FIFO */
+
+#define PI_I2S_MAX_DEVS	8
+
+static int ndevs = 1;
+module_param(ndevs, int, 0444);
+MODULE_PARM_DESC(ndevs, "Number of I2S ports (sound cards) to register (1-8).");
+
 static struct resource ldt_resource[] = {
+	{
+		.start	= PI_I2S_BASE,
+		.end	= PI_I2S_BASE + PI_I2S_SIZE - 1,
+		.flags	= IORESOURCE_MEM,
+	},
+	{
+		.start	= PI_I2S_GDMA_TX,
+		.end	= PI_I2S_GDMA_TX,
+		.flags	= IORESOURCE_DMA,
+	},
 };
 
-static void ldt_dev_release(struct device *dev)
-{
-}
+static struct platform_device *ldt_platform_devices[PI_I2S_MAX_DEVS];
 
-static struct platform_device ldt_platform_device = {
-	.name	= "snd_pi_i2s_pcm",
-	.id	= -1,
-};
+static void ldt_plat_dev_exit(void);
 
+/*
+ * One device per port, ids 0..ndevs-1, each probed as its own card.
+ * The SoC has a single I2S controller, so only port 0 carries its
+ * registers.
+ */
 static int ldt_plat_dev_init(void)
 {
-	return platform_device_register(&ldt_platform_device);
+	struct platform_device *pdev;
+	int i;
+
+	for (i = 0; i < clamp(ndevs, 1, PI_I2S_MAX_DEVS); i++) {
+		pdev = platform_device_register_simple("snd_pi_i2s_pcm", i,
+				i ? NULL : ldt_resource,
+				i ? 0 : ARRAY_SIZE(ldt_resource));
+		if (IS_ERR(pdev)) {
+			ldt_plat_dev_exit();
+			return PTR_ERR(pdev);
+		}
+		ldt_platform_devices[i] = pdev;
+	}
+
+	return 0;
 }
 
 static void ldt_plat_dev_exit(void)
 {
-	platform_device_unregister(&ldt_platform_device);
+	int i;
+
+	for (i = PI_I2S_MAX_DEVS - 1; i >= 0; i--) {
+		if (ldt_platform_devices[i])
+			platform_device_unregister(ldt_platform_devices[i]);
+		ldt_platform_devices[i] = NULL;
+	}
 }
 
 module_init(ldt_plat_dev_init);
@@ -17,8 +17,15 @@
 #include <linux/debugfs.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
+#ifdef CONFIG_X86
+#include <asm/i387.h>
+#endif
 
 #include <sound/core.h>
 #include <sound/control.h>
@@ -27,55 +34,1926 @@
 #include <sound/info.h>
 #include <sound/initval.h>
 
+#include "snd_pcm_pi_i2s_src.h"
+
 MODULE_AUTHOR("Jollen Chen");
 MODULE_DESCRIPTION("PCM ALSA driver template");
 MODULE_LICENSE("GPL");
 
-static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;	/* Index 0-MAX */
-static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;	/* ID for this card */
+static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;	/* Index 0-MAX */
+static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;	/* ID for this card */
+static int pcm_substreams = 4;
+
+module_param_array(index, int, NULL, 0444);
+MODULE_PARM_DESC(index, "Index value for each I2S port.");
+module_param_array(id, charp, NULL, 0444);
+MODULE_PARM_DESC(id, "ID string for each I2S port.");
+
+module_param(pcm_substreams, int, 0444);
+MODULE_PARM_DESC(pcm_substreams, "Playback substreams mixed by the driver (1-16).");
+
+static int link_rate;
+module_param(link_rate, int, 0444);
+MODULE_PARM_DESC(link_rate, "Fixed I2S link rate in Hz, 0 follows the first stream started.");
+
+static bool low_latency;
+module_param(low_latency, bool, 0644);
+MODULE_PARM_DESC(low_latency, "Allow periods down to LL_PERIOD_BYTES_MIN bytes for low-latency clients.");
+
+static char *backend = "sim";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Output backend: \"sim\" (simulated FIFO) or \"i2s\" (MT7688 I2S fed by GDMA).");
+
+static int i2s_refclk = 40000000;
+module_param(i2s_refclk, int, 0444);
+MODULE_PARM_DESC(i2s_refclk, "Clock feeding the MT7688 I2S divider, in Hz.");
+
+static int sim_fifo_depth = 32;
+module_param(sim_fifo_depth, int, 0644);
+MODULE_PARM_DESC(sim_fifo_depth, "Simulated I2S FIFO depth in frames.");
+
+static int sim_dma_burst = 8;
+module_param(sim_dma_burst, int, 0644);
+MODULE_PARM_DESC(sim_dma_burst, "Simulated DMA burst size in frames.");
+
+static int src_quality = 2;
+module_param(src_quality, int, 0644);
+MODULE_PARM_DESC(src_quality, "Rate converter for non-link rates: 0 off, 1 low, 2 medium, 3 high.");
+
+/* output ring of the in-driver mixer, in native S16_LE stereo frames */
+#define MIX_FRAMES	16384
+#define MIX_CHANNELS	2
+#define MIX_MAX_INPUTS	16
+#define MIX_CHUNK	256	/* frames converted per pass, stays in L1 */
+#define MAX_CHANNELS	8
+#define SRC_IN_FRAMES	1024	/* input frames staged per SRC pass */
+#define SRC_MAX_TAPS	128	/* longest filter after stretching */
+#define MAX_TICKING	(MIX_MAX_INPUTS + 1)	/* playback inputs + capture */
+#define LL_PERIOD_BYTES_MIN	64
+
+/* volume controls: 0..100 in 0.5 dB steps from -50 dB, 0 is mute */
+#define VOL_MAX		100
+#define GAIN_UNITY	32768	/* Q15 */
+#define DOWNMIX_3DB	23170	/* -3 dB, 1/sqrt(2) in Q15 */
+
+static const DECLARE_TLV_DB_SCALE(mychip_db_scale, -5000, 50, 1);
+
+/* Q15 gain for each volume step below VOL_MAX */
+static const u16 mychip_vol_gain[VOL_MAX] = {
+	0, 110, 116, 123, 130, 138, 146, 155,
+	164, 174, 184, 195, 207, 219, 232, 246,
+	260, 276, 292, 309, 328, 347, 368, 389,
+	413, 437, 463, 490, 519, 550, 583, 617,
+	654, 693, 734, 777, 823, 872, 924, 978,
+	1036, 1098, 1163, 1232, 1305, 1382, 1464, 1550,
+	1642, 1740, 1843, 1952, 2068, 2190, 2320, 2457,
+	2603, 2757, 2920, 3093, 3277, 3471, 3677, 3894,
+	4125, 4370, 4629, 4903, 5193, 5501, 5827, 6172,
+	6538, 6925, 7336, 7771, 8231, 8719, 9235, 9783,
+	10362, 10976, 11627, 12315, 13045, 13818, 14637, 15504,
+	16423, 17396, 18427, 19519, 20675, 21900, 23198, 24573,
+	26029, 27571, 29205, 30935,
+};
+
+struct mychip;
+
+/*
+ * Output backend: consumes what the mixer produces. All callbacks run
+ * under chip->lock; start/stop bracket the output clock, push hands over
+ * the frames just mixed into the output ring, link_pos tells how far the
+ * link has shifted out and so clocks the mixer. start also sets
+ * chip->link_prefill, what the link needs queued before it runs; a
+ * backend that underruns raises chip->link_xrun.
+ */
+struct mychip_backend_ops {
+	const char *name;
+	int (*probe)(struct mychip *chip, struct platform_device *pdev);
+	void (*remove)(struct mychip *chip);
+	void (*start)(struct mychip *chip, unsigned int rate);
+	void (*stop)(struct mychip *chip);
+	void (*push)(struct mychip *chip, u64 pos, snd_pcm_uframes_t frames);
+	u64 (*link_pos)(struct mychip *chip);
+	void (*proc_read)(struct mychip *chip, struct snd_info_buffer *buffer);
+};
+
+/*
+ * Per-substream timing statistics, kept across opens so they can be
+ * read after a glitch. Shown and reset through /proc/asound/cardN/stats-*.
+ */
+struct mychip_stats {
+	spinlock_t lock;
+	u64 periods;			/* snd_pcm_period_elapsed() calls */
+	u64 xruns;			/* underruns or overruns */
+	u64 wake_ns_max;		/* period boundary to period_elapsed */
+	u64 wake_ns_total;
+	u64 ptr_calls;
+	snd_pcm_uframes_t ptr_last;
+	snd_pcm_uframes_t ptr_step_min;	/* smallest non-zero pointer advance */
+	u64 copy_ns_total;		/* .copy, or loopback fill for capture */
+	u64 copy_ns_max;
+	u64 copy_calls;
+	u64 hw_params_ns_last;		/* time spent in the hw_params callback */
+	u64 hw_params_ns_max;
+	u64 first_period_ns_last;	/* hw_params to first period_elapsed */
+	u64 first_period_ns_max;
+};
+
+struct mychip {
+	struct snd_card *card;
+	struct snd_pcm *pcm;
+	const struct mychip_backend_ops *backend;
+	void *backend_data;
+	struct hrtimer tick;		/* one period clock for all streams */
+	struct tasklet_struct tick_tasklet;
+	spinlock_t lock;		/* protects everything below */
+	struct list_head running;	/* playback streams being mixed */
+	struct list_head ticking;	/* started streams, on chip->tick */
+	bool tick_armed;
+	ktime_t phase_base;		/* boundary grid for phase_rate streams */
+	unsigned int phase_rate;
+	u64 ticks;			/* timer expiries */
+	u64 tick_periods;		/* period_elapsed calls they raised */
+	s16 *mix_buf;
+	s16 mix_scratch[MIX_CHUNK * MAX_CHANNELS];	/* conversion output */
+	s16 src_l[SRC_IN_FRAMES];			/* SRC input, planar */
+	s16 src_r[SRC_IN_FRAMES];
+	s16 src_out[MIX_CHUNK * MIX_CHANNELS];
+	u64 src_ns[MIX_MAX_INPUTS];			/* SRC cost per input */
+	u64 src_frames[MIX_MAX_INPUTS];
+	u64 src_latency_ns[MIX_MAX_INPUTS];
+	unsigned int mix_rate;		/* rate of the first stream started */
+	u64 mix_pos;			/* output frames mixed so far */
+	u64 mix_lead;			/* frames kept mixed ahead of the link */
+	ktime_t mix_next;		/* next mixer service on chip->tick */
+	bool mix_pending;		/* service due, tasklet not yet run */
+	unsigned int link_prefill;
+	bool link_xrun;			/* backend underran, stop playback */
+	u64 mix_runs;
+	u64 mix_ns_total;
+	u64 mix_ns_max;
+	u64 mix_ns_last;
+	u64 mix_frames;
+	u64 mix_period;			/* shortest input period, mix rate */
+	int master_vol;
+	int master_sw;
+	int pcm_vol[MIX_MAX_INPUTS];
+	int pcm_sw[MIX_MAX_INPUTS];
+	struct mychip_stats stats[2][MIX_MAX_INPUTS];	/* [stream][substream] */
+};
+
+/*
+ * Per-substream transport engine. Without I2S hardware the stream is
+ * clocked by time: the hardware pointer is derived from elapsed time at
+ * the configured rate. One hrtimer per card fires at the earliest period
+ * boundary of all started streams; streams sharing a rate start on a
+ * common boundary grid, so their periods end on the same tick and their
+ * snd_pcm_period_elapsed() calls go out in one tasklet pass.
+ */
+struct mychip_pcm {
+	struct mychip *chip;
+	struct snd_pcm_substream *substream;
+	struct mychip_stats *stats;
+	struct list_head list;	/* on chip->running while playing */
+	struct list_head tick_list;	/* on chip->ticking while started */
+	bool elapsed_pending;	/* boundary passed, tasklet not yet run */
+	atomic_t running;
+	unsigned int rate;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+	ktime_t base_time;	/* start of the current run */
+	u64 base_frames;	/* frames consumed before the current run */
+	u64 periods;		/* period boundaries passed so far */
+	ktime_t period_time;	/* last boundary the timer saw pass */
+	ktime_t hw_params_time;	/* for hw_params-to-first-period latency */
+	bool first_period_seen;
+	u64 loop_filled;	/* capture: frames written by the loopback */
+	u64 mixed;		/* playback: frames the mixer is done with */
+	bool mix_join;		/* playback: joins the mixer at base_time */
+	u64 ptr_frames;		/* frame count the last pointer call reported */
+	/* rate converter, set up when rate differs from the mixer rate */
+	const s16 *src_coeffs;	/* SRC_PHASES x src_taps, NULL if off */
+	unsigned int src_taps;
+	u64 src_ipos;		/* input frame centred by the next output ... */
+	u32 src_frac;		/* ... plus this fraction, 0.32 */
+	u64 src_step;		/* input frames per output frame, 32.32 */
+	bool src_primed;
+	s16 *src_table;		/* downsampling bank, SRC_PHASES x SRC_MAX_TAPS */
+	const s16 *src_table_proto;	/* prototype and step it was built for */
+	u64 src_table_step;
+};
+
+/* hardware definition */
+static struct snd_pcm_hardware snd_mychip_playback_hw = {
+        .info = (SNDRV_PCM_INFO_MMAP |
+                 SNDRV_PCM_INFO_INTERLEAVED |
+                 SNDRV_PCM_INFO_BLOCK_TRANSFER |
+                 SNDRV_PCM_INFO_MMAP_VALID |
+                 SNDRV_PCM_INFO_HAS_WALL_CLOCK),
+        .formats =          (SNDRV_PCM_FMTBIT_S16_LE |
+                             SNDRV_PCM_FMTBIT_S24_LE |
+                             SNDRV_PCM_FMTBIT_S32_LE |
+                             SNDRV_PCM_FMTBIT_FLOAT_LE),
+        .rates =            SNDRV_PCM_RATE_8000_192000,
+        .rate_min =         8000,
+        .rate_max =         192000,
+        .channels_min =     1,
+        .channels_max =     8,
+        .buffer_bytes_max = 512 * 1024,
+        .period_bytes_min = 4096,
+        .period_bytes_max = 256 * 1024,
+        .periods_min =      1,
+        .periods_max =      1024,
+};
+
+/* hardware definition */
+static struct snd_pcm_hardware snd_mychip_capture_hw = {
+        .info = (SNDRV_PCM_INFO_MMAP |
+                 SNDRV_PCM_INFO_INTERLEAVED |
+                 SNDRV_PCM_INFO_BLOCK_TRANSFER |
+                 SNDRV_PCM_INFO_MMAP_VALID |
+                 SNDRV_PCM_INFO_HAS_WALL_CLOCK),
+        .formats =          SNDRV_PCM_FMTBIT_S16_LE,
+        .rates =            SNDRV_PCM_RATE_8000_48000,
+        .rate_min =         8000,
+        .rate_max =         48000,
+        .channels_min =     2,
+        .channels_max =     2,
+        .buffer_bytes_max = 32768,
+        .period_bytes_min = 4096,
+        .period_bytes_max = 32768,
+        .periods_min =      1,
+        .periods_max =      1024,
+};
+
+static u64 mychip_frames_to_ns(u64 frames, unsigned int rate)
+{
+	u32 rem;
+	u64 sec = div_u64_rem(frames, rate, &rem);
+
+	return sec * NSEC_PER_SEC + div_u64((u64)rem * NSEC_PER_SEC, rate);
+}
+
+static u64 mychip_ns_to_frames(u64 ns, unsigned int rate)
+{
+	u32 rem;
+	u64 sec = div_u64_rem(ns, NSEC_PER_SEC, &rem);
+
+	return sec * rate + div_u64((u64)rem * rate, NSEC_PER_SEC);
+}
+
+/******** Simulated FIFO backend ********/
+
+/*
+ * Models an I2S transmitter fed by DMA: mixed frames queue in the output
+ * ring, the DMA moves them into the FIFO in whole bursts, and the link
+ * drains the FIFO at the sample clock once it has been prefilled to its
+ * depth. If the link catches up with what DMA could deliver, that is an
+ * underrun: the link stalls and waits for a fresh prefill.
+ */
+struct mychip_sim {
+	unsigned int rate;
+	unsigned int fifo_depth;	/* frames */
+	unsigned int burst;		/* frames per DMA burst */
+	u64 produced;			/* frames pushed by the mixer */
+	u64 link_pos;			/* frames shifted out on the link */
+	u64 link_base;			/* link_pos when the link (re)started */
+	ktime_t link_start;
+	bool link_running;
+	u64 underruns;
+	u64 underruns_seen;		/* already raised as link_xrun */
+	u64 underrun_frames;
+};
+
+static int mychip_sim_probe(struct mychip *chip, struct platform_device *pdev)
+{
+	struct mychip_sim *sim;
+
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
+
+	chip->backend_data = sim;
+	return 0;
+}
+
+static void mychip_sim_remove(struct mychip *chip)
+{
+	kfree(chip->backend_data);
+}
+
+/* bring the simulation forward to the current time */
+static void mychip_sim_advance(struct mychip_sim *sim)
+{
+	u64 avail, target;
+	u32 partial;
+
+	/* DMA only moves whole bursts, a partial one waits for more data */
+	div_u64_rem(sim->produced, sim->burst, &partial);
+	avail = sim->produced - partial;
+
+	if (!sim->link_running) {
+		if (avail - sim->link_pos < sim->fifo_depth)
+			return;
+		sim->link_running = true;
+		sim->link_start = ktime_get();
+		sim->link_base = sim->link_pos;
+		return;
+	}
+
+	target = sim->link_base + mychip_ns_to_frames(ktime_to_ns(ktime_sub(
+			ktime_get(), sim->link_start)), sim->rate);
+	if (target <= avail) {
+		sim->link_pos = target;
+		return;
+	}
+
+	sim->underruns++;
+	sim->underrun_frames += target - avail;
+	sim->link_pos = avail;
+	sim->link_running = false;
+}
+
+static void mychip_sim_start(struct mychip *chip, unsigned int rate)
+{
+	struct mychip_sim *sim = chip->backend_data;
+
+	sim->rate = rate;
+	sim->fifo_depth = max(sim_fifo_depth, 1);
+	sim->burst = clamp(sim_dma_burst, 1, (int)sim->fifo_depth);
+	sim->produced = 0;
+	sim->link_pos = 0;
+	sim->link_running = false;
+	sim->underruns_seen = sim->underruns;
+
+	/* the link starts once a full FIFO's worth of bursts has arrived */
+	chip->link_prefill = sim->fifo_depth + sim->burst;
+}
+
+static void mychip_sim_stop(struct mychip *chip)
+{
+	struct mychip_sim *sim = chip->backend_data;
+
+	mychip_sim_advance(sim);
+	sim->link_running = false;
+}
+
+static void mychip_sim_push(struct mychip *chip, u64 pos,
+			    snd_pcm_uframes_t frames)
+{
+	struct mychip_sim *sim = chip->backend_data;
+
+	/* account for the time elapsed before this data arrived */
+	mychip_sim_advance(sim);
+	sim->produced = pos + frames;
+	mychip_sim_advance(sim);
+}
+
+static u64 mychip_sim_link_pos(struct mychip *chip)
+{
+	struct mychip_sim *sim = chip->backend_data;
+
+	mychip_sim_advance(sim);
+	if (sim->underruns != sim->underruns_seen) {
+		sim->underruns_seen = sim->underruns;
+		chip->link_xrun = true;
+	}
+	return sim->link_pos;
+}
+
+static void mychip_sim_proc_read(struct mychip *chip,
+				 struct snd_info_buffer *buffer)
+{
+	struct mychip_sim *sim = chip->backend_data;
+
+	mychip_sim_advance(sim);
+	snd_iprintf(buffer, "fifo depth:      %u frames\n", sim->fifo_depth);
+	snd_iprintf(buffer, "dma burst:       %u frames\n", sim->burst);
+	snd_iprintf(buffer, "link:            %s\n",
+		    sim->link_running ? "running" : "stalled");
+	snd_iprintf(buffer, "fill:            %llu frames\n",
+		    sim->produced - sim->link_pos);
+	snd_iprintf(buffer, "underruns:       %llu\n", sim->underruns);
+	snd_iprintf(buffer, "underrun frames: %llu\n", sim->underrun_frames);
+}
+
+static const struct mychip_backend_ops mychip_sim_backend = {
+	.name =		"sim",
+	.probe =	mychip_sim_probe,
+	.remove =	mychip_sim_remove,
+	.start =	mychip_sim_start,
+	.stop =		mychip_sim_stop,
+	.push =		mychip_sim_push,
+	.link_pos =	mychip_sim_link_pos,
+	.proc_read =	mychip_sim_proc_read,
+};
+
+/******** MT7688 I2S/GDMA backend ********/
+
+/*
+ * I2S controller registers, relative to the MEM resource of the platform
+ * device (0x10000a00 on the MT7688). The controller has no DMA engine of
+ * its own: GDMA writes the TX FIFO through I2S_WREG, one S16_LE stereo
+ * frame per 32-bit word.
+ */
+#define I2S_CFG0		0x00
+#define  I2S_CFG0_EN		(1 << 31)
+#define  I2S_CFG0_DMA_EN	(1 << 30)
+#define  I2S_CFG0_TX_EN		(1 << 24)
+#define  I2S_CFG0_SLAVE		(1 << 16)
+#define  I2S_CFG0_TX_THRES(x)	((x) << 4)	/* GDMA request level */
+#define I2S_INT_STATUS		0x04		/* write 1 to clear */
+#define I2S_INT_EN		0x08
+#define  I2S_INT_TX_FAULT	(1 << 3)
+#define  I2S_INT_TX_OVRUN	(1 << 2)
+#define  I2S_INT_TX_UNRUN	(1 << 1)
+#define  I2S_INT_TX_THRES	(1 << 0)
+#define I2S_FF_STATUS		0x0c
+#define  I2S_FF_TX_AVAIL(v)	((v) & 0xff)	/* free TX FIFO words */
+#define I2S_WREG		0x10		/* TX FIFO write port */
+#define I2S_DIVCMP		0x20
+#define  I2S_DIVCMP_CLKEN	(1 << 31)
+#define I2S_DIVINT		0x24
+
+#define I2S_FIFO_FRAMES		16
+#define I2S_DMA_BURST		4		/* words per GDMA request */
+#define I2S_RING_FRAMES		MIX_FRAMES	/* same frames as mix_buf */
+#define I2S_RING_BYTES		(I2S_RING_FRAMES * MIX_CHANNELS * sizeof(s16))
+
+/*
+ * GDMA runs a cyclic transfer over a coherent copy of the mixer ring,
+ * so pos in the ring and in chip->mix_buf are the same frame modulo
+ * MIX_FRAMES. The transfer starts once the mixer has pushed the
+ * prefill. The residue tells how far GDMA has read, the FIFO level how
+ * much of that has not been shifted out yet. GDMA never waits for the
+ * mixer: reading past what was pushed replays stale frames, which is an
+ * underrun just like the FIFO running dry (I2S_INT_TX_UNRUN).
+ */
+struct mychip_i2s {
+	void __iomem *regs;
+	resource_size_t phys;
+	struct dma_chan *chan;
+	unsigned int dma_req;		/* GDMA request line of the TX FIFO */
+	struct device *dma_dev;
+	s16 *ring;
+	dma_addr_t ring_dma;
+	dma_cookie_t cookie;
+	unsigned int rate;
+	unsigned int prefill;
+	bool running;
+	bool xrun;			/* raised since the last start */
+	u64 produced;			/* frames pushed by the mixer */
+	u64 dma_pos;			/* frames GDMA has read */
+	u32 dma_off;			/* ... and where that is in the ring */
+	u64 link_pos;
+	u64 underruns;
+	u64 fifo_underruns;		/* I2S_INT_TX_UNRUN seen */
+};
+
+static int mychip_i2s_probe(struct mychip *chip, struct platform_device *pdev)
+{
+	struct mychip_i2s *i2s;
+	struct resource *res, *dma;
+	dma_cap_mask_t mask;
+	int err = -ENOMEM;
+
+	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	dma = platform_get_resource(pdev, IORESOURCE_DMA, 0);
+	if (!res || !dma)
+		return -ENODEV;
+
+	i2s = kzalloc(sizeof(*i2s), GFP_KERNEL);
+	if (!i2s)
+		return -ENOMEM;
+
+	i2s->phys = res->start;
+	i2s->dma_req = dma->start;
+	i2s->regs = ioremap(res->start, resource_size(res));
+	if (!i2s->regs)
+		goto __nomem;
+
+	/* GDMA is the only slave engine on the SoC, any channel will do */
+	i2s->chan = dma_request_slave_channel(&pdev->dev, "tx");
+	if (!i2s->chan) {
+		dma_cap_zero(mask);
+		dma_cap_set(DMA_SLAVE, mask);
+		dma_cap_set(DMA_CYCLIC, mask);
+		i2s->chan = dma_request_channel(mask, NULL, NULL);
+	}
+	if (!i2s->chan) {
+		err = -ENODEV;
+		goto __nomap;
+	}
+
+	/* the ring belongs to the device that masters the bus, GDMA */
+	i2s->dma_dev = i2s->chan->device->dev;
+	i2s->ring = dma_alloc_coherent(i2s->dma_dev, I2S_RING_BYTES,
+				       &i2s->ring_dma, GFP_KERNEL);
+	if (!i2s->ring)
+		goto __nochan;
+
+	writel(0, i2s->regs + I2S_CFG0);
+	writel(0, i2s->regs + I2S_INT_EN);
+	chip->backend_data = i2s;
+	return 0;
+
+      __nochan:
+	dma_release_channel(i2s->chan);
+      __nomap:
+	iounmap(i2s->regs);
+      __nomem:
+	kfree(i2s);
+	return err;
+}
+
+static void mychip_i2s_remove(struct mychip *chip)
+{
+	struct mychip_i2s *i2s = chip->backend_data;
+
+	dmaengine_terminate_all(i2s->chan);
+	writel(0, i2s->regs + I2S_CFG0);
+	dma_free_coherent(i2s->dma_dev, I2S_RING_BYTES, i2s->ring,
+			  i2s->ring_dma);
+	dma_release_channel(i2s->chan);
+	iounmap(i2s->regs);
+	kfree(i2s);
+}
+
+/*
+ * Bit clock for two 32-bit slots per frame, from the reference clock
+ * through the fractional divider: bclk = refclk / 2 / (DIVINT + DIVCMP/512).
+ */
+static void mychip_i2s_set_rate(struct mychip_i2s *i2s, unsigned int rate)
+{
+	u64 div = div_u64((u64)i2s_refclk * 512, 2 * 64 * rate);
+
+	writel(div >> 9, i2s->regs + I2S_DIVINT);
+	writel((div & 0x1ff) | I2S_DIVCMP_CLKEN, i2s->regs + I2S_DIVCMP);
+}
+
+static void mychip_i2s_start(struct mychip *chip, unsigned int rate)
+{
+	struct mychip_i2s *i2s = chip->backend_data;
+
+	i2s->rate = rate;
+	i2s->produced = 0;
+	i2s->dma_pos = 0;
+	i2s->dma_off = 0;
+	i2s->link_pos = 0;
+	i2s->running = false;
+	i2s->xrun = false;
+	memset(i2s->ring, 0, I2S_RING_BYTES);
+
+	/* GDMA reads a FIFO's worth ahead of the link, plus a request */
+	i2s->prefill = I2S_FIFO_FRAMES + I2S_DMA_BURST;
+	chip->link_prefill = i2s->prefill;
+}
+
+/* start GDMA and the transmitter on the prefilled ring */
+static void mychip_i2s_kick(struct mychip *chip)
+{
+	struct mychip_i2s *i2s = chip->backend_data;
+	struct dma_slave_config conf = {
+		.direction =		DMA_MEM_TO_DEV,
+		.dst_addr =		i2s->phys + I2S_WREG,
+		.dst_addr_width =	DMA_SLAVE_BUSWIDTH_4_BYTES,
+		.dst_maxburst =		I2S_DMA_BURST,
+		.slave_id =		i2s->dma_req,
+	};
+	struct dma_async_tx_descriptor *desc = NULL;
+
+	mychip_i2s_set_rate(i2s, i2s->rate);
+	writel(I2S_INT_TX_FAULT | I2S_INT_TX_OVRUN | I2S_INT_TX_UNRUN |
+	       I2S_INT_TX_THRES, i2s->regs + I2S_INT_STATUS);
+
+	if (!dmaengine_slave_config(i2s->chan, &conf))
+		desc = dmaengine_prep_dma_cyclic(i2s->chan, i2s->ring_dma,
+						 I2S_RING_BYTES,
+						 I2S_RING_BYTES / 4,
+						 DMA_MEM_TO_DEV, 0);
+	if (!desc) {
+		printk(KERN_ERR "snd_pi_i2s: no GDMA transfer for the TX FIFO\n");
+		i2s->xrun = true;
+		chip->link_xrun = true;
+		return;
+	}
+	i2s->cookie = dmaengine_submit(desc);
+	dma_async_issue_pending(i2s->chan);
+
+	/* master mode, TX only; the status bits are polled, not raised */
+	writel(I2S_CFG0_EN | I2S_CFG0_DMA_EN | I2S_CFG0_TX_EN |
+	       I2S_CFG0_TX_THRES(I2S_DMA_BURST), i2s->regs + I2S_CFG0);
+	i2s->running = true;
+}
+
+static void mychip_i2s_stop(struct mychip *chip)
+{
+	struct mychip_i2s *i2s = chip->backend_data;
+
+	writel(0, i2s->regs + I2S_CFG0);
+	dmaengine_terminate_all(i2s->chan);
+	i2s->running = false;
+}
+
+static void mychip_i2s_push(struct mychip *chip, u64 pos,
+			    snd_pcm_uframes_t frames)
+{
+	struct mychip_i2s *i2s = chip->backend_data;
+	snd_pcm_uframes_t chunk;
+	u32 d;
+
+	/* the mixer stays within a ring of the link, so nothing is lapped */
+	while (frames) {
+		div_u64_rem(pos, I2S_RING_FRAMES, &d);
+		chunk = min_t(snd_pcm_uframes_t, frames, I2S_RING_FRAMES - d);
+		memcpy(i2s->ring + d * MIX_CHANNELS,
+		       chip->mix_buf + d * MIX_CHANNELS,
+		       chunk * MIX_CHANNELS * sizeof(s16));
+		pos += chunk;
+		frames -= chunk;
+	}
+	i2s->produced = pos;
+
+	if (!i2s->running && !i2s->xrun && i2s->produced >= i2s->prefill)
+		mychip_i2s_kick(chip);
+}
+
+/* bring dma_pos forward from the residue of the cyclic transfer */
+static void mychip_i2s_advance(struct mychip_i2s *i2s)
+{
+	struct dma_tx_state state;
+	u32 off;
+
+	if (dmaengine_tx_status(i2s->chan, i2s->cookie, &state) ==
+	    DMA_ERROR || state.residue > I2S_RING_BYTES)
+		return;
+
+	off = (I2S_RING_BYTES - state.residue) % I2S_RING_BYTES;
+	off /= MIX_CHANNELS * sizeof(s16);
+	i2s->dma_pos += (off + I2S_RING_FRAMES - i2s->dma_off) %
+			I2S_RING_FRAMES;
+	i2s->dma_off = off;
+}
+
+static u64 mychip_i2s_link_pos(struct mychip *chip)
+{
+	struct mychip_i2s *i2s = chip->backend_data;
+	u32 status, fill;
+	u64 pos;
+
+	if (!i2s->running)
+		return i2s->link_pos;
+
+	mychip_i2s_advance(i2s);
+
+	status = readl(i2s->regs + I2S_INT_STATUS);
+	if (status & I2S_INT_TX_UNRUN)
+		i2s->fifo_underruns++;
+	writel(status, i2s->regs + I2S_INT_STATUS);
+
+	if (!i2s->xrun && (status & (I2S_INT_TX_UNRUN | I2S_INT_TX_FAULT) ||
+			   i2s->dma_pos > i2s->produced)) {
+		i2s->xrun = true;
+		i2s->underruns++;
+		chip->link_xrun = true;
+	}
+
+	/* what GDMA has read but the FIFO still holds is not out yet */
+	fill = I2S_FIFO_FRAMES - min_t(u32, I2S_FF_TX_AVAIL(
+			readl(i2s->regs + I2S_FF_STATUS)), I2S_FIFO_FRAMES);
+	pos = i2s->dma_pos > fill ? i2s->dma_pos - fill : 0;
+	if (pos > i2s->link_pos)
+		i2s->link_pos = pos;
+	return i2s->link_pos;
+}
+
+static void mychip_i2s_proc_read(struct mychip *chip,
+				 struct snd_info_buffer *buffer)
+{
+	struct mychip_i2s *i2s = chip->backend_data;
+
+	if (i2s->running)
+		mychip_i2s_advance(i2s);
+	snd_iprintf(buffer, "cfg0:            0x%08x\n",
+		    readl(i2s->regs + I2S_CFG0));
+	snd_iprintf(buffer, "int status:      0x%08x\n",
+		    readl(i2s->regs + I2S_INT_STATUS));
+	snd_iprintf(buffer, "fifo status:     0x%08x\n",
+		    readl(i2s->regs + I2S_FF_STATUS));
+	snd_iprintf(buffer, "gdma channel:    %s (request %u)\n",
+		    dma_chan_name(i2s->chan), i2s->dma_req);
+	snd_iprintf(buffer, "link:            %s\n",
+		    i2s->running ? "running" : "stalled");
+	snd_iprintf(buffer, "fill:            %lld frames\n",
+		    (long long)(i2s->produced - i2s->dma_pos));
+	snd_iprintf(buffer, "underruns:       %llu\n", i2s->underruns);
+	snd_iprintf(buffer, "fifo underruns:  %llu\n", i2s->fifo_underruns);
+}
+
+static const struct mychip_backend_ops mychip_i2s_backend = {
+	.name =		"i2s",
+	.probe =	mychip_i2s_probe,
+	.remove =	mychip_i2s_remove,
+	.start =	mychip_i2s_start,
+	.stop =		mychip_i2s_stop,
+	.push =		mychip_i2s_push,
+	.link_pos =	mychip_i2s_link_pos,
+	.proc_read =	mychip_i2s_proc_read,
+};
+
+/* total frames consumed since prepare */
+static u64 mychip_pcm_frames(struct mychip_pcm *dpcm)
+{
+	u64 frames = dpcm->base_frames;
+	s64 ns;
+
+	if (atomic_read(&dpcm->running)) {
+		/* a phase-aligned start may lie slightly in the future */
+		ns = ktime_to_ns(ktime_sub(ktime_get(), dpcm->base_time));
+		if (ns > 0)
+			frames += mychip_ns_to_frames(ns, dpcm->rate);
+	}
+
+	return frames;
+}
+
+/* absolute expiry of the next period boundary, so jitter never accumulates */
+static ktime_t mychip_pcm_next_period(struct mychip_pcm *dpcm)
+{
+	u64 next = (dpcm->periods + 1) * dpcm->period_size - dpcm->base_frames;
+
+	return ktime_add_ns(dpcm->base_time,
+			    mychip_frames_to_ns(next, dpcm->rate));
+}
+
+/* program the card timer for when, unless it already fires earlier */
+static void mychip_tick_arm(struct mychip *chip, ktime_t when)
+{
+	if (chip->tick_armed &&
+	    ktime_to_ns(hrtimer_get_expires(&chip->tick)) <= ktime_to_ns(when))
+		return;
+
+	hrtimer_start(&chip->tick, when, HRTIMER_MODE_ABS);
+	chip->tick_armed = true;
+}
+
+/* the link drains mix_lead frames in this long: service at half of it */
+static ktime_t mychip_mix_service(struct mychip *chip, ktime_t now)
+{
+	return ktime_add_ns(now, mychip_frames_to_ns(max_t(u64,
+				chip->mix_lead / 2, 1), chip->mix_rate));
+}
+
+/*
+ * Card timer: mark every stream whose period boundary has passed, and
+ * every deferred playback start that is due to join the mixer, and
+ * re-arm for the earliest upcoming one. While playback runs the timer
+ * also brings the mixer back before the link drains what is queued.
+ * Re-arming happens here, under chip->lock like every other
+ * hrtimer_start() on this timer, and the callback itself always
+ * returns HRTIMER_NORESTART.
+ */
+static enum hrtimer_restart mychip_tick(struct hrtimer *timer)
+{
+	struct mychip *chip = container_of(timer, struct mychip, tick);
+	struct mychip_pcm *dpcm;
+	ktime_t now = ktime_get(), boundary, next = ktime_set(0, 0);
+	bool pending = false, have_next = false;
+
+	spin_lock(&chip->lock);
+	chip->tick_armed = false;
+	chip->ticks++;
+
+	list_for_each_entry(dpcm, &chip->ticking, tick_list) {
+		if (dpcm->mix_join) {
+			if (ktime_to_ns(dpcm->base_time) <= ktime_to_ns(now)) {
+				chip->mix_pending = true;
+				pending = true;
+			} else if (!have_next || ktime_to_ns(dpcm->base_time) <
+						 ktime_to_ns(next)) {
+				next = dpcm->base_time;
+				have_next = true;
+			}
+		}
+		boundary = mychip_pcm_next_period(dpcm);
+		while (ktime_to_ns(boundary) <= ktime_to_ns(now)) {
+			dpcm->periods++;
+			dpcm->period_time = boundary;
+			dpcm->elapsed_pending = true;
+			pending = true;
+			boundary = mychip_pcm_next_period(dpcm);
+		}
+		if (!have_next || ktime_to_ns(boundary) < ktime_to_ns(next)) {
+			next = boundary;
+			have_next = true;
+		}
+	}
+
+	if (!list_empty(&chip->running)) {
+		if (ktime_to_ns(chip->mix_next) <= ktime_to_ns(now)) {
+			chip->mix_pending = true;
+			pending = true;
+			chip->mix_next = mychip_mix_service(chip, now);
+		}
+		if (!have_next ||
+		    ktime_to_ns(chip->mix_next) < ktime_to_ns(next)) {
+			next = chip->mix_next;
+			have_next = true;
+		}
+	}
+
+	if (have_next)
+		mychip_tick_arm(chip, next);
+	spin_unlock(&chip->lock);
+
+	if (pending)
+		tasklet_hi_schedule(&chip->tick_tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+static void mychip_ring_silence(struct snd_pcm_runtime *dst, u64 dst_pos,
+				snd_pcm_uframes_t frames)
+{
+	u32 d;
+	snd_pcm_uframes_t n;
+
+	while (frames) {
+		div_u64_rem(dst_pos, dst->buffer_size, &d);
+		n = min_t(snd_pcm_uframes_t, frames, dst->buffer_size - d);
+
+		snd_pcm_format_set_silence(dst->format,
+				dst->dma_area + frames_to_bytes(dst, d),
+				n * dst->channels);
+
+		dst_pos += n;
+		frames -= n;
+	}
+}
+
+/*
+ * Saturating 16-bit accumulate, dst[i] = sat(dst[i] + src[i]). The SSE2
+ * kernel handles 16 samples per iteration with paddsw; the scalar loop
+ * covers the tail and non-x86 builds. simd means the caller holds the
+ * FPU (kernel_fpu_begin), taken once per mixer pass.
+ */
+static void mychip_mix_s16_scalar(s16 *dst, const s16 *src, unsigned int n)
+{
+	unsigned int i;
+	int v;
+
+	for (i = 0; i < n; i++) {
+		v = dst[i] + src[i];
+		dst[i] = clamp_t(int, v, SHRT_MIN, SHRT_MAX);
+	}
+}
+
+static void mychip_mix_s16(s16 *dst, const s16 *src, unsigned int n,
+			   bool simd)
+{
+	unsigned int i = 0;
+
+#ifdef CONFIG_X86
+	if (simd && n >= 16) {
+		for (; i + 16 <= n; i += 16)
+			asm volatile("movdqu   (%0), %%xmm0\n\t"
+				     "movdqu 16(%0), %%xmm1\n\t"
+				     "movdqu   (%1), %%xmm2\n\t"
+				     "movdqu 16(%1), %%xmm3\n\t"
+				     "paddsw %%xmm2, %%xmm0\n\t"
+				     "paddsw %%xmm3, %%xmm1\n\t"
+				     "movdqu %%xmm0,   (%0)\n\t"
+				     "movdqu %%xmm1, 16(%0)\n\t"
+				     : : "r" (dst + i), "r" (src + i)
+				     : "memory");
+	}
+#endif
+	mychip_mix_s16_scalar(dst + i, src + i, n - i);
+}
+
+/*
+ * Gain fused into the accumulate: dst[i] = sat(dst[i] + (src[i] * g >> 15))
+ * with g in Q15 below unity. SSE2 widens the products to 32 bits with
+ * pmullw/pmulhw, shifts, and packs back with saturation, 8 samples per
+ * iteration, so the samples are read exactly once on their way out.
+ */
+static void mychip_mix_s16_gain_scalar(s16 *dst, const s16 *src,
+				       unsigned int n, u16 gain)
+{
+	unsigned int i;
+	int v;
+
+	for (i = 0; i < n; i++) {
+		v = dst[i] + ((src[i] * (int)gain) >> 15);
+		dst[i] = clamp_t(int, v, SHRT_MIN, SHRT_MAX);
+	}
+}
+
+static void mychip_mix_s16_gain(s16 *dst, const s16 *src, unsigned int n,
+				u16 gain, bool simd)
+{
+	unsigned int i = 0;
+#ifdef CONFIG_X86
+	u16 g[8] __aligned(16) = { gain, gain, gain, gain,
+				   gain, gain, gain, gain };
+
+	if (simd && n >= 8) {
+		asm volatile("movdqa %0, %%xmm7"
+			     : : "m" (*(const u16 (*)[8])g));
+		for (; i + 8 <= n; i += 8)
+			asm volatile("movdqu (%1), %%xmm0\n\t"
+				     "movdqa %%xmm0, %%xmm1\n\t"
+				     "pmullw %%xmm7, %%xmm0\n\t"
+				     "pmulhw %%xmm7, %%xmm1\n\t"
+				     "movdqa %%xmm0, %%xmm2\n\t"
+				     "punpcklwd %%xmm1, %%xmm0\n\t"
+				     "punpckhwd %%xmm1, %%xmm2\n\t"
+				     "psrad $15, %%xmm0\n\t"
+				     "psrad $15, %%xmm2\n\t"
+				     "packssdw %%xmm2, %%xmm0\n\t"
+				     "movdqu (%0), %%xmm3\n\t"
+				     "paddsw %%xmm3, %%xmm0\n\t"
+				     "movdqu %%xmm0, (%0)\n\t"
+				     : : "r" (dst + i), "r" (src + i)
+				     : "memory");
+	}
+#endif
+	mychip_mix_s16_gain_scalar(dst + i, src + i, n - i, gain);
+}
+
+static u32 mychip_vol_to_gain(int vol, int sw)
+{
+	if (!sw)
+		return 0;
+	return vol >= VOL_MAX ? GAIN_UNITY : mychip_vol_gain[vol];
+}
+
+/* master and per-input volume/mute folded into one Q15 gain */
+static u32 mychip_input_gain(struct mychip *chip, int input)
+{
+	return (mychip_vol_to_gain(chip->master_vol, chip->master_sw) *
+		mychip_vol_to_gain(chip->pcm_vol[input], chip->pcm_sw[input]))
+		>> 15;
+}
+
+/*
+ * Format conversion to the native S16. Each kernel converts n samples;
+ * SSE2 does 8 per iteration, the scalar loops the tail. FLOAT_LE is
+ * decoded with integer arithmetic in the scalar path since the kernel
+ * cannot use the FPU outside kernel_fpu_begin/end.
+ */
+static s16 mychip_f32_to_s16(u32 bits)
+{
+	int exp = (bits >> 23) & 0xff;
+	u32 mant = (bits & 0x7fffff) | 0x800000;
+	int shift = 135 - exp;	/* value * 32768 == mant >> shift */
+	u32 v;
+
+	if (!exp || shift >= 24)
+		return 0;
+	v = shift <= 8 ? 32768 : mant >> shift;
+
+	if (bits & 0x80000000)
+		return -(s32)min_t(u32, v, 32768);
+	return min_t(u32, v, 32767);
+}
+
+#ifdef CONFIG_X86
+static const u32 mychip_f32_consts[3][4] __aligned(16) = {
+	{ 0x3f800000, 0x3f800000, 0x3f800000, 0x3f800000 },	/* 1.0 */
+	{ 0xbf800000, 0xbf800000, 0xbf800000, 0xbf800000 },	/* -1.0 */
+	{ 0x47000000, 0x47000000, 0x47000000, 0x47000000 },	/* 32768.0 */
+};
+#endif
+
+static void mychip_convert_s16(s16 *dst, const void *src,
+			       snd_pcm_format_t format, unsigned int n,
+			       bool simd)
+{
+	const u32 *in32 = src;
+	unsigned int i = 0;
+
+	if (format == SNDRV_PCM_FORMAT_S16_LE) {
+		memcpy(dst, src, n * sizeof(s16));
+		return;
+	}
+
+#ifdef CONFIG_X86
+	if (simd && n >= 8) {
+		switch (format) {
+		case SNDRV_PCM_FORMAT_S32_LE:
+			for (; i + 8 <= n; i += 8)
+				asm volatile("movdqu   (%1), %%xmm0\n\t"
+					     "movdqu 16(%1), %%xmm1\n\t"
+					     "psrad $16, %%xmm0\n\t"
+					     "psrad $16, %%xmm1\n\t"
+					     "packssdw %%xmm1, %%xmm0\n\t"
+					     "movdqu %%xmm0, (%0)\n\t"
+					     : : "r" (dst + i), "r" (in32 + i)
+					     : "memory");
+			break;
+		case SNDRV_PCM_FORMAT_S24_LE:
+			for (; i + 8 <= n; i += 8)
+				asm volatile("movdqu   (%1), %%xmm0\n\t"
+					     "movdqu 16(%1), %%xmm1\n\t"
+					     "pslld $8, %%xmm0\n\t"
+					     "pslld $8, %%xmm1\n\t"
+					     "psrad $16, %%xmm0\n\t"
+					     "psrad $16, %%xmm1\n\t"
+					     "packssdw %%xmm1, %%xmm0\n\t"
+					     "movdqu %%xmm0, (%0)\n\t"
+					     : : "r" (dst + i), "r" (in32 + i)
+					     : "memory");
+			break;
+		case SNDRV_PCM_FORMAT_FLOAT_LE:
+			asm volatile("movaps %0, %%xmm5\n\t"
+				     "movaps %1, %%xmm6\n\t"
+				     "movaps %2, %%xmm7\n\t"
+				     : : "m" (mychip_f32_consts[0]),
+					 "m" (mychip_f32_consts[1]),
+					 "m" (mychip_f32_consts[2]));
+			for (; i + 8 <= n; i += 8)
+				asm volatile("movups   (%1), %%xmm0\n\t"
+					     "movups 16(%1), %%xmm1\n\t"
+					     "minps %%xmm5, %%xmm0\n\t"
+					     "minps %%xmm5, %%xmm1\n\t"
+					     "maxps %%xmm6, %%xmm0\n\t"
+					     "maxps %%xmm6, %%xmm1\n\t"
+					     "mulps %%xmm7, %%xmm0\n\t"
+					     "mulps %%xmm7, %%xmm1\n\t"
+					     "cvtps2dq %%xmm0, %%xmm0\n\t"
+					     "cvtps2dq %%xmm1, %%xmm1\n\t"
+					     "packssdw %%xmm1, %%xmm0\n\t"
+					     "movdqu %%xmm0, (%0)\n\t"
+					     : : "r" (dst + i), "r" (in32 + i)
+					     : "memory");
+			break;
+		default:
+			break;
+		}
+	}
+#endif
+
+	switch (format) {
+	case SNDRV_PCM_FORMAT_S32_LE:
+		for (; i < n; i++)
+			dst[i] = (s32)in32[i] >> 16;
+		break;
+	case SNDRV_PCM_FORMAT_S24_LE:
+		for (; i < n; i++)
+			dst[i] = (s32)(in32[i] << 8) >> 16;
+		break;
+	case SNDRV_PCM_FORMAT_FLOAT_LE:
+		for (; i < n; i++)
+			dst[i] = mychip_f32_to_s16(in32[i]);
+		break;
+	default:
+		memset(dst + i, 0, (n - i) * sizeof(s16));
+		break;
+	}
+}
+
+/*
+ * Reduce interleaved S16 frames to the stereo I2S layout in place: mono
+ * is duplicated, multichannel is folded down ITU-R BS.775 style, with
+ * centre and surrounds at -3 dB into their side and LFE dropped. ALSA
+ * orders the channels FL FR RL RR FC LFE SL SR; three channels are 2.1.
+ */
+static void mychip_to_stereo(s16 *buf, unsigned int channels,
+			     unsigned int frames)
+{
+	const s16 *in;
+	unsigned int i;
+	s32 l, r, c;
+
+	if (channels == 1) {
+		for (i = frames; i-- > 0; ) {
+			buf[2 * i + 1] = buf[i];
+			buf[2 * i] = buf[i];
+		}
+	} else if (channels > 2) {
+		for (i = 0; i < frames; i++) {
+			in = buf + channels * i;
+			l = 0;
+			r = 0;
+			c = 0;
+			if (channels >= 4) {
+				l += in[2];
+				r += in[3];
+			}
+			if (channels >= 5)
+				c = in[4];
+			if (channels >= 8) {
+				l += in[6];
+				r += in[7];
+			}
+			l = in[0] + (((s64)(l + c) * DOWNMIX_3DB) >> 15);
+			r = in[1] + (((s64)(r + c) * DOWNMIX_3DB) >> 15);
+			buf[2 * i] = clamp_t(s32, l, SHRT_MIN, SHRT_MAX);
+			buf[2 * i + 1] = clamp_t(s32, r, SHRT_MIN, SHRT_MAX);
+		}
+	}
+}
+
+/* capture carries the mixer output as is, so it must be native */
+static bool mychip_mixable(struct mychip *chip, struct snd_pcm_runtime *rt)
+{
+	return rt->format == SNDRV_PCM_FORMAT_S16_LE &&
+	       rt->channels == MIX_CHANNELS && rt->rate == chip->mix_rate;
+}
+
+/*
+ * Accumulate frames of one input into the output. Native input is mixed
+ * straight from its DMA area; anything else is converted once, in L1
+ * sized chunks, into the scratch buffer and mixed from there.
+ */
+static void mychip_mix_input(struct mychip *chip, s16 *dst,
+			     struct snd_pcm_runtime *rt, const void *src,
+			     snd_pcm_uframes_t frames, u32 gain, bool simd)
+{
+	const s16 *in;
+	unsigned int chunk;
+
+	while (frames) {
+		if (rt->format == SNDRV_PCM_FORMAT_S16_LE &&
+		    rt->channels == MIX_CHANNELS) {
+			chunk = frames;
+			in = src;
+		} else {
+			chunk = min_t(snd_pcm_uframes_t, frames, MIX_CHUNK);
+			mychip_convert_s16(chip->mix_scratch, src, rt->format,
+					   chunk * rt->channels, simd);
+			mychip_to_stereo(chip->mix_scratch, rt->channels, chunk);
+			in = chip->mix_scratch;
+		}
+
+		if (gain == GAIN_UNITY)
+			mychip_mix_s16(dst, in, chunk * MIX_CHANNELS, simd);
+		else
+			mychip_mix_s16_gain(dst, in, chunk * MIX_CHANNELS,
+					    gain, simd);
+
+		dst += chunk * MIX_CHANNELS;
+		src += frames_to_bytes(rt, chunk);
+		frames -= chunk;
+	}
+}
+
+/******** Sample-rate converter ********/
+
+/*
+ * Two-channel FIR of one polyphase branch: out = sum(h[k] * x[k]) for
+ * the left and right planes. SSE2 uses pmaddwd over 8 taps at a time;
+ * taps are always a multiple of 8 and the coefficient rows 16-aligned.
+ */
+static void mychip_fir2(const s16 *l, const s16 *r, const s16 *h,
+			unsigned int taps, bool simd, s32 *out)
+{
+	unsigned int k;
+#ifdef CONFIG_X86
+	s32 acc[8] __aligned(16);
+	unsigned long blocks = taps / 8;
+
+	if (simd) {
+		asm volatile("pxor %%xmm0, %%xmm0\n\t"
+			     "pxor %%xmm1, %%xmm1\n\t"
+			     "1:\n\t"
+			     "movdqa (%2), %%xmm2\n\t"
+			     "movdqu (%0), %%xmm3\n\t"
+			     "movdqu (%1), %%xmm4\n\t"
+			     "pmaddwd %%xmm2, %%xmm3\n\t"
+			     "pmaddwd %%xmm2, %%xmm4\n\t"
+			     "paddd %%xmm3, %%xmm0\n\t"
+			     "paddd %%xmm4, %%xmm1\n\t"
+			     "add $16, %0\n\t"
+			     "add $16, %1\n\t"
+			     "add $16, %2\n\t"
+			     "dec %3\n\t"
+			     "jnz 1b\n\t"
+			     "movdqa %%xmm0, (%4)\n\t"
+			     "movdqa %%xmm1, 16(%4)\n\t"
+			     : "+r" (l), "+r" (r), "+r" (h), "+r" (blocks)
+			     : "r" (acc)
+			     : "memory", "cc");
+		out[0] = acc[0] + acc[1] + acc[2] + acc[3];
+		out[1] = acc[4] + acc[5] + acc[6] + acc[7];
+		return;
+	}
+#endif
+	out[0] = 0;
+	out[1] = 0;
+	for (k = 0; k < taps; k++) {
+		out[0] += h[k] * l[k];
+		out[1] += h[k] * r[k];
+	}
+}
+
+/*
+ * One tap of the prototype stretched by s, h(t / s) / s, with inv = 2^31 / s
+ * and num the distance from the output point in 1/SRC_PHASES input frames.
+ * The nearest tabulated prototype phase stands in for h.
+ */
+static s32 mychip_src_stretch_tap(const s16 *proto, unsigned int taps,
+				  u64 inv, int num)
+{
+	s64 g;
+	int q, k, p;
+
+	g = (abs(num) * inv + (1ULL << 30)) >> 31;
+	if (num < 0)
+		g = -g;
+
+	/* prototype tap k of phase p sits at (taps/2 - 1 - k) + p/SRC_PHASES */
+	q = (int)(taps / 2) * SRC_PHASES - g;
+	if (q <= 0 || q > (int)taps * SRC_PHASES)
+		return 0;
+	k = (q - 1) / SRC_PHASES;
+	p = (k + 1) * SRC_PHASES - q;
+
+	return ((s64)proto[p * taps + k] * (s64)inv) >> 31;
+}
+
+/*
+ * Downsampling moves the cutoff down to 0.45 of the output rate by
+ * stretching the prototype by the rate ratio, with the taps scaled to
+ * match. Each phase is renormalized to unity DC gain. Returns false if
+ * the stretched filter would exceed SRC_MAX_TAPS.
+ */
+static bool mychip_src_stretch(struct mychip_pcm *dpcm, const s16 *proto,
+			       unsigned int taps)
+{
+	u64 inv = div64_u64(1ULL << 63, dpcm->src_step);
+	unsigned int ntaps, nhalf, p, k;
+	s32 sum, r, v;
+
+	ntaps = ALIGN(taps * (unsigned int)((dpcm->src_step +
+					     0xffffffffULL) >> 32), 8);
+	if (ntaps > SRC_MAX_TAPS || !dpcm->src_table)
+		return false;
+	nhalf = ntaps / 2;
+
+	if (dpcm->src_table_proto != proto ||
+	    dpcm->src_table_step != dpcm->src_step) {
+		for (p = 0; p < SRC_PHASES; p++) {
+			sum = 0;
+			for (k = 0; k < ntaps; k++)
+				sum += mychip_src_stretch_tap(proto, taps, inv,
+					((int)nhalf - 1 - (int)k) * SRC_PHASES + p);
+			r = sum > 0 ? div_s64(32768LL << 16, sum) : 0;
+
+			for (k = 0; k < ntaps; k++) {
+				v = mychip_src_stretch_tap(proto, taps, inv,
+					((int)nhalf - 1 - (int)k) * SRC_PHASES + p);
+				dpcm->src_table[p * ntaps + k] =
+					clamp_t(s32, ((s64)v * r) >> 16,
+						SHRT_MIN, SHRT_MAX);
+			}
+		}
+		dpcm->src_table_proto = proto;
+		dpcm->src_table_step = dpcm->src_step;
+	}
+
+	dpcm->src_coeffs = dpcm->src_table;
+	dpcm->src_taps = ntaps;
+	return true;
+}
+
+static void mychip_src_setup(struct mychip *chip, struct mychip_pcm *dpcm)
+{
+	const s16 *proto;
+	unsigned int taps;
+
+	dpcm->src_coeffs = NULL;
+	dpcm->src_taps = 0;
+	if (dpcm->rate == chip->mix_rate)
+		return;
+
+	/* the read position advances even if the converter is off */
+	dpcm->src_step = div_u64((u64)dpcm->rate << 32, chip->mix_rate);
+	dpcm->src_primed = false;
+
+	switch (src_quality) {
+	case 1:
+		dpcm->src_coeffs = &src_coeffs_low[0][0];
+		dpcm->src_taps = ARRAY_SIZE(src_coeffs_low[0]);
+		break;
+	case 2:
+		dpcm->src_coeffs = &src_coeffs_medium[0][0];
+		dpcm->src_taps = ARRAY_SIZE(src_coeffs_medium[0]);
+		break;
+	case 3:
+		dpcm->src_coeffs = &src_coeffs_high[0][0];
+		dpcm->src_taps = ARRAY_SIZE(src_coeffs_high[0]);
+		break;
+	default:
+		return;
+	}
+
+	/* the banks cut off at 0.45 of the input rate, right for upsampling */
+	proto = dpcm->src_coeffs;
+	taps = dpcm->src_taps;
+	if (dpcm->src_step > (1ULL << 32) &&
+	    !mychip_src_stretch(dpcm, proto, taps)) {
+		printk(KERN_WARNING "snd_pi_i2s: no converter for %u -> %u Hz, input muted\n",
+		       dpcm->rate, chip->mix_rate);
+		dpcm->src_coeffs = NULL;
+		dpcm->src_taps = 0;
+		return;
+	}
+
+	/* group delay of the filter, half the taps at the input rate */
+	chip->src_latency_ns[dpcm->substream->number] =
+		mychip_frames_to_ns(dpcm->src_taps / 2, dpcm->rate);
+}
+
+/* stage input frames [first, first + frames) as planar S16 stereo */
+static void mychip_src_stage(struct mychip *chip, struct snd_pcm_runtime *rt,
+			     u64 first, unsigned int frames, bool simd)
+{
+	unsigned int done = 0;
+	unsigned int chunk, i;
+	u32 pos;
+
+	while (done < frames) {
+		div_u64_rem(first + done, rt->buffer_size, &pos);
+		chunk = min3(frames - done, (unsigned int)MIX_CHUNK,
+			     (unsigned int)(rt->buffer_size - pos));
+
+		mychip_convert_s16(chip->mix_scratch,
+				   rt->dma_area + frames_to_bytes(rt, pos),
+				   rt->format, chunk * rt->channels, simd);
+		mychip_to_stereo(chip->mix_scratch, rt->channels, chunk);
+
+		for (i = 0; i < chunk; i++) {
+			chip->src_l[done + i] = chip->mix_scratch[2 * i];
+			chip->src_r[done + i] = chip->mix_scratch[2 * i + 1];
+		}
+		done += chunk;
+	}
+}
+
+/*
+ * Move the converter's read position on by n output frames without
+ * filtering, for a muted input or one with the converter off.
+ */
+static void mychip_src_skip(struct mychip_pcm *dpcm, snd_pcm_uframes_t n)
+{
+	u64 adv = (u64)n * dpcm->src_step + dpcm->src_frac;
+
+	dpcm->src_ipos += adv >> 32;
+	dpcm->src_frac = (u32)adv;
+}
+
+/*
+ * Resample n output frames of one input and mix them in at out_pos. The
+ * converter keeps its own fractional read position, which is the only
+ * thing that moves the stream's pointer, so no input frame is reported
+ * consumed before the filter has read it.
+ */
+static void mychip_src_mix(struct mychip *chip, struct mychip_pcm *dpcm,
+			   u64 out_pos, snd_pcm_uframes_t n, u32 gain,
+			   bool simd)
+{
+	struct snd_pcm_runtime *rt = dpcm->substream->runtime;
+	unsigned int taps = dpcm->src_taps;
+	unsigned int half = taps / 2;
+	unsigned int max_out, chunk, span, i, phase, rel;
+	u64 t0, first;
+	u64 ipos;
+	u32 frac, d;
+	s32 acc[2];
+
+	t0 = local_clock();
+
+	max_out = div_u64((u64)(SRC_IN_FRAMES - taps - 2) << 32,
+			  dpcm->src_step);
+	max_out = clamp_t(unsigned int, max_out, 1, MIX_CHUNK);
+
+	while (n) {
+		chunk = min_t(snd_pcm_uframes_t, n, max_out);
+		div_u64_rem(out_pos, MIX_FRAMES, &d);
+		chunk = min_t(unsigned int, chunk, MIX_FRAMES - d);
+
+		ipos = dpcm->src_ipos;
+		frac = dpcm->src_frac;
+		first = ipos - half + 1;
+		span = (((u64)chunk * dpcm->src_step + frac) >> 32) + taps + 1;
+		mychip_src_stage(chip, rt, first, span, simd);
+
+		for (i = 0; i < chunk; i++) {
+			rel = ipos - half + 1 - first;
+			phase = frac >> (32 - ilog2(SRC_PHASES));
+			mychip_fir2(chip->src_l + rel, chip->src_r + rel,
+				    dpcm->src_coeffs + phase * taps, taps,
+				    simd, acc);
+			chip->src_out[2 * i] = clamp_t(s32, acc[0] >> 15,
+						       SHRT_MIN, SHRT_MAX);
+			chip->src_out[2 * i + 1] = clamp_t(s32, acc[1] >> 15,
+							   SHRT_MIN, SHRT_MAX);
+
+			/* advance the 32.32 position by one output frame */
+			if ((u32)dpcm->src_step > ~frac)
+				ipos++;
+			frac += (u32)dpcm->src_step;
+			ipos += dpcm->src_step >> 32;
+		}
+
+		if (gain == GAIN_UNITY)
+			mychip_mix_s16(chip->mix_buf + d * MIX_CHANNELS,
+				       chip->src_out, chunk * MIX_CHANNELS,
+				       simd);
+		else
+			mychip_mix_s16_gain(chip->mix_buf + d * MIX_CHANNELS,
+					    chip->src_out,
+					    chunk * MIX_CHANNELS, gain, simd);
+
+		dpcm->src_ipos = ipos;
+		dpcm->src_frac = frac;
+		out_pos += chunk;
+		n -= chunk;
+		chip->src_frames[dpcm->substream->number] += chunk;
+	}
+
+	chip->src_ns[dpcm->substream->number] += local_clock() - t0;
+}
+
+/*
+ * Mix one input into the output ring at [out_pos, out_pos + n) and move
+ * its read position on. Every input reads on from where it stopped, so
+ * its pointer only ever covers frames that are in the mix.
+ */
+static void mychip_mix_one(struct mychip *chip, struct mychip_pcm *dpcm,
+			   u64 out_pos, snd_pcm_uframes_t n, bool simd)
+{
+	struct snd_pcm_runtime *rt = dpcm->substream->runtime;
+	unsigned int half = dpcm->src_taps / 2;
+	u64 src_pos;
+	u32 d, s_;
+	snd_pcm_uframes_t left, chunk;
+	u32 gain;
+
+	gain = mychip_input_gain(chip, dpcm->substream->number);
+
+	if (rt->rate != chip->mix_rate) {
+		if (!dpcm->src_primed) {
+			/* first filter reads from the stream position on */
+			dpcm->src_ipos = dpcm->mixed + half;
+			dpcm->src_frac = 0;
+			dpcm->src_primed = true;
+		}
+		if (dpcm->src_coeffs && gain)
+			mychip_src_mix(chip, dpcm, out_pos, n, gain, simd);
+		else
+			mychip_src_skip(dpcm, n);
+		/* frames below the next filter window are done with */
+		dpcm->mixed = dpcm->src_ipos - half;
+		return;
+	}
+
+	left = gain ? n : 0;
+	src_pos = dpcm->mixed;
+	while (left) {
+		div_u64_rem(out_pos, MIX_FRAMES, &d);
+		div_u64_rem(src_pos, rt->buffer_size, &s_);
+		chunk = min3(left, (snd_pcm_uframes_t)MIX_FRAMES - d,
+			     rt->buffer_size - s_);
+		mychip_mix_input(chip, chip->mix_buf + d * MIX_CHANNELS,
+				 rt, rt->dma_area + frames_to_bytes(rt, s_),
+				 chunk, gain, simd);
+		out_pos += chunk;
+		src_pos += chunk;
+		left -= chunk;
+	}
+	dpcm->mixed += n;
+}
+
+/*
+ * Mix every running playback stream into the output ring until it is
+ * mix_lead frames ahead of the link, at most one ring at a time. The
+ * backend's link position is the clock: while the link stalls, nothing
+ * is consumed. The mixer is what consumes input: each stream's pointer
+ * is the position it has mixed up to. Called with chip->lock held, from
+ * the tick tasklet and from the pointer callback. The FPU is taken once
+ * for the whole pass; the kernels below only look at the simd flag.
+ */
+static void mychip_mix_run(struct mychip *chip)
+{
+	struct mychip_pcm *dpcm;
+	u64 t0, cost, now, dst_pos;
+	u32 d;
+	snd_pcm_uframes_t n, left, chunk;
+	bool simd = false;
+
+	if (list_empty(&chip->running))
+		return;
+
+	now = chip->backend->link_pos(chip) + chip->mix_lead;
+	if (chip->link_xrun)
+		tasklet_hi_schedule(&chip->tick_tasklet);
+	if (chip->mix_pos >= now)
+		return;
+
+#ifdef CONFIG_X86
+	simd = cpu_has_xmm2 && irq_fpu_usable();
+	if (simd)
+		kernel_fpu_begin();
+#endif
+	while (chip->mix_pos < now) {
+		n = min_t(u64, now - chip->mix_pos, MIX_FRAMES);
+		t0 = local_clock();
+
+		left = n;
+		dst_pos = chip->mix_pos;
+		while (left) {
+			div_u64_rem(dst_pos, MIX_FRAMES, &d);
+			chunk = min_t(snd_pcm_uframes_t, left, MIX_FRAMES - d);
+			memset(chip->mix_buf + d * MIX_CHANNELS, 0,
+			       chunk * MIX_CHANNELS * sizeof(s16));
+			dst_pos += chunk;
+			left -= chunk;
+		}
+
+		list_for_each_entry(dpcm, &chip->running, list)
+			mychip_mix_one(chip, dpcm, chip->mix_pos, n, simd);
+
+		chip->backend->push(chip, chip->mix_pos, n);
+		chip->mix_pos += n;
+
+		cost = local_clock() - t0;
+		chip->mix_runs++;
+		chip->mix_frames += n;
+		chip->mix_ns_total += cost;
+		chip->mix_ns_last = cost;
+		if (cost > chip->mix_ns_max)
+			chip->mix_ns_max = cost;
+	}
+#ifdef CONFIG_X86
+	if (simd)
+		kernel_fpu_end();
+#endif
+}
+
+/*
+ * Capture loopback: fill the capture ring up to its current position with
+ * the most recently mixed output. Runs from the pointer callback, so every
+ * frame the pointer reports has been written. Silence when nothing
+ * compatible plays.
+ */
+static void mychip_loopback_fill(struct mychip_pcm *capt)
+{
+	struct mychip *chip = capt->chip;
+	struct snd_pcm_runtime *dst = capt->substream->runtime;
+	unsigned long flags;
+	u64 now, src_pos, dst_pos;
+	u32 d, s_;
+	snd_pcm_uframes_t n, left, chunk;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	now = mychip_pcm_frames(capt);
+	if (now - capt->loop_filled > dst->buffer_size)
+		capt->loop_filled = now - dst->buffer_size;
+	n = now - capt->loop_filled;
+	if (!n)
+		goto unlock;
+
+	mychip_mix_run(chip);
+
+	if (list_empty(&chip->running) || !mychip_mixable(chip, dst) ||
+	    chip->mix_pos < n) {
+		mychip_ring_silence(dst, capt->loop_filled, n);
+		goto out;
+	}
+
+	left = n;
+	dst_pos = capt->loop_filled;
+	src_pos = chip->mix_pos - n;
+	while (left) {
+		div_u64_rem(dst_pos, dst->buffer_size, &d);
+		div_u64_rem(src_pos, MIX_FRAMES, &s_);
+		chunk = min3(left, dst->buffer_size - d,
+			     (snd_pcm_uframes_t)MIX_FRAMES - s_);
+		memcpy(dst->dma_area + frames_to_bytes(dst, d),
+		       chip->mix_buf + s_ * MIX_CHANNELS,
+		       frames_to_bytes(dst, chunk));
+		dst_pos += chunk;
+		src_pos += chunk;
+		left -= chunk;
+	}
+out:
+	capt->loop_filled = now;
+unlock:
+	spin_unlock_irqrestore(&chip->lock, flags);
+}
+
+static void mychip_stats_copy(struct mychip_stats *st, u64 t0)
+{
+	u64 cost = local_clock() - t0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	st->copy_ns_total += cost;
+	st->copy_ns_max = max(st->copy_ns_max, cost);
+	st->copy_calls++;
+	spin_unlock_irqrestore(&st->lock, flags);
+}
+
+static void mychip_stats_first_period(struct mychip_pcm *dpcm)
+{
+	struct mychip_stats *st = dpcm->stats;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), dpcm->hw_params_time));
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	st->first_period_ns_last = ns;
+	st->first_period_ns_max = max(st->first_period_ns_max, ns);
+	spin_unlock_irqrestore(&st->lock, flags);
+}
+
+static void mychip_stats_period(struct mychip_pcm *dpcm)
+{
+	struct mychip_stats *st = dpcm->stats;
+	s64 wake = ktime_to_ns(ktime_sub(ktime_get(), dpcm->period_time));
+	unsigned long flags;
+
+	if (wake < 0)
+		wake = 0;
+
+	spin_lock_irqsave(&st->lock, flags);
+	st->periods++;
+	st->wake_ns_total += wake;
+	st->wake_ns_max = max(st->wake_ns_max, (u64)wake);
+	if (dpcm->substream->runtime->status->state == SNDRV_PCM_STATE_XRUN)
+		st->xruns++;
+	spin_unlock_irqrestore(&st->lock, flags);
+}
+
+/*
+ * How far ahead of the link to mix: half the shortest period of the
+ * inputs, since the timer comes back at half that, but never less than
+ * the backend needs queued to start the link.
+ */
+static void mychip_mix_lead_update(struct mychip *chip)
+{
+	struct mychip_pcm *dpcm;
+	u64 period = MIX_FRAMES;
+
+	list_for_each_entry(dpcm, &chip->running, list)
+		period = min(period, div_u64((u64)dpcm->period_size *
+					     chip->mix_rate, dpcm->rate));
+
+	if (!list_empty(&chip->running))
+		chip->mix_period = period;
+	chip->mix_lead = max_t(u64, period / 2, chip->link_prefill);
+}
+
+/*
+ * Put a playback stream on the mixer inputs, reading from base_frames
+ * on. Called with chip->lock held once the stream's base_time has come,
+ * so a phase-aligned start consumes nothing before its clock starts.
+ */
+static void mychip_mixer_join(struct mychip *chip, struct mychip_pcm *dpcm)
+{
+	dpcm->mix_join = false;
+	if (list_empty(&chip->running)) {
+		/*
+		 * first input restarts the output clock, at the link
+		 * rate if fixed, else at its own rate
+		 */
+		chip->mix_rate = link_rate ? link_rate : dpcm->rate;
+		chip->mix_pos = 0;
+		chip->mix_lead = 0;
+		chip->link_xrun = false;
+		chip->backend->start(chip, chip->mix_rate);
+	}
+	/* mix the others up to now so this input joins from here */
+	mychip_mix_run(chip);
+	mychip_src_setup(chip, dpcm);
+	dpcm->mixed = dpcm->base_frames;
+	list_add_tail(&dpcm->list, &chip->running);
+	mychip_mix_lead_update(chip);
+	chip->mix_next = mychip_mix_service(chip, ktime_get());
+	mychip_tick_arm(chip, chip->mix_next);
+}
+
+/*
+ * Deliver one tick's worth of period boundaries: a single mixer pass for
+ * all playback streams in the batch (or for a due mixer service), then
+ * period_elapsed for each. If the link underran, every playback stream
+ * it was fed from is stopped with XRUN. The core may stop a stream from
+ * inside period_elapsed, so chip->lock is dropped before calling into it.
+ */
+static void mychip_tick_tasklet(unsigned long arg)
+{
+	struct mychip *chip = (struct mychip *)arg;
+	struct mychip_pcm *batch[MAX_TICKING], *dpcm;
+	struct mychip_pcm *xrun[MIX_MAX_INPUTS];
+	unsigned long flags;
+	ktime_t now;
+	bool mix = false;
+	int n = 0, nxrun = 0, i;
 
-struct mychip {
-	struct snd_card *card;
-	struct snd_pcm *pcm;
-};
+	spin_lock_irqsave(&chip->lock, flags);
+	now = ktime_get();
+	list_for_each_entry(dpcm, &chip->ticking, tick_list) {
+		if (dpcm->mix_join &&
+		    ktime_to_ns(dpcm->base_time) <= ktime_to_ns(now))
+			mychip_mixer_join(chip, dpcm);
+		if (!dpcm->elapsed_pending || n == MAX_TICKING)
+			continue;
+		dpcm->elapsed_pending = false;
+		batch[n++] = dpcm;
+		if (dpcm->substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+			mix = true;
+	}
+	if (mix || chip->mix_pending)
+		mychip_mix_run(chip);
+	chip->mix_pending = false;
+	chip->tick_periods += n;
 
-/* hardware definition */
-static struct snd_pcm_hardware snd_mychip_playback_hw = {
-        .info = (SNDRV_PCM_INFO_MMAP |
-                 SNDRV_PCM_INFO_INTERLEAVED |
-                 SNDRV_PCM_INFO_BLOCK_TRANSFER |
-                 SNDRV_PCM_INFO_MMAP_VALID),
-        .formats =          SNDRV_PCM_FMTBIT_S16_LE,
-        .rates =            SNDRV_PCM_RATE_8000_48000,
-        .rate_min =         8000,
-        .rate_max =         48000,
-        .channels_min =     2,
-        .channels_max =     2,
-        .buffer_bytes_max = 32768,
-        .period_bytes_min = 4096,
-        .period_bytes_max = 32768,
-        .periods_min =      1,
-        .periods_max =      1024,
-};
+	if (chip->link_xrun) {
+		chip->link_xrun = false;
+		list_for_each_entry(dpcm, &chip->running, list)
+			if (nxrun < MIX_MAX_INPUTS)
+				xrun[nxrun++] = dpcm;
+	}
+	spin_unlock_irqrestore(&chip->lock, flags);
 
-/* hardware definition */
-static struct snd_pcm_hardware snd_mychip_capture_hw = {
-        .info = (SNDRV_PCM_INFO_MMAP |
-                 SNDRV_PCM_INFO_INTERLEAVED |
-                 SNDRV_PCM_INFO_BLOCK_TRANSFER |
-                 SNDRV_PCM_INFO_MMAP_VALID),
-        .formats =          SNDRV_PCM_FMTBIT_S16_LE,
-        .rates =            SNDRV_PCM_RATE_8000_48000,
-        .rate_min =         8000,
-        .rate_max =         48000,
-        .channels_min =     2,
-        .channels_max =     2,
-        .buffer_bytes_max = 32768,
-        .period_bytes_min = 4096,
-        .period_bytes_max = 32768,
-        .periods_min =      1,
-        .periods_max =      1024,
-};
+	/* close waits for this tasklet, so the streams stay valid */
+	for (i = 0; i < nxrun; i++) {
+		snd_pcm_stream_lock_irqsave(xrun[i]->substream, flags);
+		if (snd_pcm_running(xrun[i]->substream))
+			snd_pcm_stop(xrun[i]->substream, SNDRV_PCM_STATE_XRUN);
+		snd_pcm_stream_unlock_irqrestore(xrun[i]->substream, flags);
+
+		spin_lock_irqsave(&xrun[i]->stats->lock, flags);
+		xrun[i]->stats->xruns++;
+		spin_unlock_irqrestore(&xrun[i]->stats->lock, flags);
+	}
+
+	for (i = 0; i < n; i++) {
+		dpcm = batch[i];
+		if (!atomic_read(&dpcm->running))
+			continue;
+
+		if (!dpcm->first_period_seen) {
+			dpcm->first_period_seen = true;
+			mychip_stats_first_period(dpcm);
+		}
+
+		snd_pcm_period_elapsed(dpcm->substream);
+		mychip_stats_period(dpcm);
+	}
+}
+
+/*
+ * First grid boundary at or after want, the grid being every period of
+ * dpcm counted from chip->phase_base.
+ */
+static ktime_t mychip_phase_align(struct mychip *chip,
+				  struct mychip_pcm *dpcm, ktime_t want)
+{
+	s64 since = ktime_to_ns(ktime_sub(want, chip->phase_base));
+	u64 frames, k;
+
+	if (since >= 0) {
+		frames = mychip_ns_to_frames(since, dpcm->rate);
+		k = div_u64(frames + dpcm->period_size - 1, dpcm->period_size);
+		return ktime_add_ns(chip->phase_base, mychip_frames_to_ns(
+				k * dpcm->period_size, dpcm->rate));
+	}
+
+	frames = mychip_ns_to_frames(-since, dpcm->rate);
+	k = div_u64(frames, dpcm->period_size);
+	return ktime_sub_ns(chip->phase_base, mychip_frames_to_ns(
+			k * dpcm->period_size, dpcm->rate));
+}
+
+/*
+ * Put a starting stream on the card timer. A stream at the rate of the
+ * streams already ticking has its start deferred (by less than one of
+ * its periods) so that its first boundary falls on their grid; any
+ * other stream starts now and just adds its own boundaries. A deferred
+ * playback stream joins the mixer only when base_time comes, so what it
+ * has consumed always matches its boundaries.
+ */
+static void mychip_tick_add(struct mychip_pcm *dpcm)
+{
+	struct mychip *chip = dpcm->chip;
+	unsigned long flags;
+	ktime_t now = ktime_get(), first;
+	u64 gap_ns;
+
+	dpcm->periods = div_u64(dpcm->base_frames, dpcm->period_size);
+	gap_ns = mychip_frames_to_ns((dpcm->periods + 1) * dpcm->period_size -
+				     dpcm->base_frames, dpcm->rate);
+
+	spin_lock_irqsave(&chip->lock, flags);
+	if (list_empty(&chip->ticking)) {
+		chip->phase_base = ktime_add_ns(now, gap_ns);
+		chip->phase_rate = dpcm->rate;
+		dpcm->base_time = now;
+	} else if (dpcm->rate == chip->phase_rate) {
+		first = mychip_phase_align(chip, dpcm,
+					   ktime_add_ns(now, gap_ns));
+		dpcm->base_time = ktime_sub_ns(first, gap_ns);
+	} else {
+		dpcm->base_time = now;
+	}
+
+	dpcm->elapsed_pending = false;
+	list_add_tail(&dpcm->tick_list, &chip->ticking);
+	mychip_tick_arm(chip, mychip_pcm_next_period(dpcm));
+	spin_unlock_irqrestore(&chip->lock, flags);
+}
+
+/*
+ * Take a stream off the card timer. A tasklet pass that collected it
+ * before this may still be running; callers that free or reset the
+ * stream wait it out.
+ */
+static void mychip_tick_remove(struct mychip_pcm *dpcm)
+{
+	struct mychip *chip = dpcm->chip;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	list_del_init(&dpcm->tick_list);
+	dpcm->elapsed_pending = false;
+	spin_unlock_irqrestore(&chip->lock, flags);
+}
+
+static int mychip_pcm_engine_open(struct snd_pcm_substream *substream)
+{
+	struct mychip_pcm *dpcm;
+
+	dpcm = kzalloc(sizeof(*dpcm), GFP_KERNEL);
+	if (!dpcm)
+		return -ENOMEM;
+
+	dpcm->chip = snd_pcm_substream_chip(substream);
+	dpcm->substream = substream;
+	dpcm->stats = &dpcm->chip->stats[substream->stream][substream->number];
+	INIT_LIST_HEAD(&dpcm->list);
+	INIT_LIST_HEAD(&dpcm->tick_list);
+	atomic_set(&dpcm->running, 0);
+
+	/* power-of-two kmalloc keeps the rows 16-aligned for mychip_fir2 */
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		dpcm->src_table = kmalloc(SRC_PHASES * SRC_MAX_TAPS *
+					  sizeof(s16), GFP_KERNEL);
+		if (!dpcm->src_table) {
+			kfree(dpcm);
+			return -ENOMEM;
+		}
+	}
+
+	substream->runtime->private_data = dpcm;
+	return 0;
+}
+
+/* add a playback stream to, or remove it from, the mixer inputs */
+static void mychip_mixer_set(struct mychip_pcm *dpcm, bool running)
+{
+	struct mychip *chip = dpcm->chip;
+	unsigned long flags;
+
+	if (dpcm->substream->stream != SNDRV_PCM_STREAM_PLAYBACK)
+		return;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	if (running && list_empty(&dpcm->list)) {
+		/* a start deferred onto the phase grid joins from the tick */
+		if (ktime_to_ns(dpcm->base_time) > ktime_to_ns(ktime_get())) {
+			dpcm->mix_join = true;
+			mychip_tick_arm(chip, dpcm->base_time);
+		} else {
+			mychip_mixer_join(chip, dpcm);
+		}
+	} else if (!running) {
+		dpcm->mix_join = false;
+		if (!list_empty(&dpcm->list)) {
+			mychip_mix_run(chip);
+			list_del_init(&dpcm->list);
+			if (list_empty(&chip->running))
+				chip->backend->stop(chip);
+			else
+				mychip_mix_lead_update(chip);
+		}
+	}
+	spin_unlock_irqrestore(&chip->lock, flags);
+}
+
+static void mychip_pcm_engine_close(struct snd_pcm_substream *substream)
+{
+	struct mychip_pcm *dpcm = substream->runtime->private_data;
+
+	mychip_mixer_set(dpcm, false);
+	atomic_set(&dpcm->running, 0);
+	mychip_tick_remove(dpcm);
+	/* a tasklet pass may still hold dpcm from before the removal */
+	tasklet_unlock_wait(&dpcm->chip->tick_tasklet);
+	kfree(dpcm->src_table);
+	kfree(dpcm);
+}
 
 /* open callback */
 static int snd_mychip_playback_open(struct snd_pcm_substream *substream)
@@ -85,8 +1963,12 @@ static int snd_mychip_playback_open(struct snd_pcm_substream *substream)
 
         runtime->hw = snd_mychip_playback_hw;
         /* more hardware-initialization will be done here */
+	if (low_latency) {
+		runtime->hw.period_bytes_min = LL_PERIOD_BYTES_MIN;
+		runtime->hw.periods_min = 2;
+	}
 	printk(KERN_INFO "snd_mychip_playback_open\n");
-        return 0;
+        return mychip_pcm_engine_open(substream);
 }
 
 /* close callback */
@@ -94,6 +1976,7 @@ static int snd_mychip_playback_close(struct snd_pcm_substream *substream)
 {
         struct mychip *chip = snd_pcm_substream_chip(substream);
         /* the hardware-specific codes will be here */
+	mychip_pcm_engine_close(substream);
         return 0;
 
 }
@@ -106,7 +1989,11 @@ static int snd_mychip_capture_open(struct snd_pcm_substream *substream)
 
         runtime->hw = snd_mychip_capture_hw;
         /* more hardware-initialization will be done here */
-        return 0;
+	if (low_latency) {
+		runtime->hw.period_bytes_min = LL_PERIOD_BYTES_MIN;
+		runtime->hw.periods_min = 2;
+	}
+        return mychip_pcm_engine_open(substream);
 }
 
 /* close callback */
@@ -114,18 +2001,37 @@ static int snd_mychip_capture_close(struct snd_pcm_substream *substream)
 {
         struct mychip *chip = snd_pcm_substream_chip(substream);
         /* the hardware-specific codes will be here */
+	mychip_pcm_engine_close(substream);
         return 0;
 
 }
 
-/* hw_params callback */
+/*
+ * hw_params callback: the buffer was preallocated at card creation, so
+ * snd_pcm_lib_malloc_pages() only attaches it to the runtime.
+ */
 static int snd_mychip_pcm_hw_params(struct snd_pcm_substream *substream,
                              struct snd_pcm_hw_params *hw_params)
 {
-     	printk(KERN_INFO "snd_mychip_pcm_hw_params: \n");
+	struct mychip_pcm *dpcm = substream->runtime->private_data;
+	struct mychip_stats *st = dpcm->stats;
+	unsigned long flags;
+	u64 ns;
+	int err;
 
-        return snd_pcm_lib_malloc_pages(substream,
-                                   params_buffer_bytes(hw_params));
+	dpcm->hw_params_time = ktime_get();
+	dpcm->first_period_seen = false;
+
+        err = snd_pcm_lib_malloc_pages(substream,
+                                  params_buffer_bytes(hw_params));
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), dpcm->hw_params_time));
+	spin_lock_irqsave(&st->lock, flags);
+	st->hw_params_ns_last = ns;
+	st->hw_params_ns_max = max(st->hw_params_ns_max, ns);
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	return err;
 }
 
 /* hw_free callback */
@@ -139,10 +2045,23 @@ static int snd_mychip_pcm_prepare(struct snd_pcm_substream *substream)
 {
         struct mychip *chip = snd_pcm_substream_chip(substream);
         struct snd_pcm_runtime *runtime = substream->runtime;
+	struct mychip_pcm *dpcm = runtime->private_data;
 
         /* set up the hardware with the current configuration
          * for example...
          */
+	mychip_tick_remove(dpcm);
+	tasklet_unlock_wait(&chip->tick_tasklet);
+
+	dpcm->rate = runtime->rate;
+	dpcm->buffer_size = runtime->buffer_size;
+	dpcm->period_size = runtime->period_size;
+	dpcm->base_frames = 0;
+	dpcm->periods = 0;
+	dpcm->loop_filled = 0;
+	dpcm->mixed = 0;
+	dpcm->ptr_frames = 0;
+
         return 0;
 }
 
@@ -150,29 +2069,136 @@ static int snd_mychip_pcm_prepare(struct snd_pcm_substream *substream)
 static int snd_mychip_pcm_trigger(struct snd_pcm_substream *substream,
                                   int cmd)
 {
+	struct mychip_pcm *dpcm = substream->runtime->private_data;
+
         switch (cmd) {
         case SNDRV_PCM_TRIGGER_START:
                 /* do something to start the PCM engine */
+		mychip_tick_add(dpcm);
+		atomic_set(&dpcm->running, 1);
+		mychip_mixer_set(dpcm, true);
                 break;
         case SNDRV_PCM_TRIGGER_STOP:
                 /* do something to stop the PCM engine */
+		mychip_mixer_set(dpcm, false);
+		/* playback resumes from what the mixer actually read */
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+			dpcm->base_frames = dpcm->mixed;
+		else
+			dpcm->base_frames = mychip_pcm_frames(dpcm);
+		atomic_set(&dpcm->running, 0);
+		/* may run from the tick tasklet: only unlink, never wait */
+		mychip_tick_remove(dpcm);
                 break;
         default:
                 return -EINVAL;
         }
-}
 
-static unsigned int current_ptr = 0;
+	return 0;
+}
 
 /* pointer callback */
 static snd_pcm_uframes_t
 snd_mychip_pcm_pointer(struct snd_pcm_substream *substream)
 {
-        struct mychip *chip = snd_pcm_substream_chip(substream);
-        unsigned int current_ptr;
+	struct mychip_pcm *dpcm = substream->runtime->private_data;
+	struct mychip_stats *st = dpcm->stats;
+	struct mychip *chip = dpcm->chip;
+	snd_pcm_uframes_t step, delay = 0;
+	unsigned long flags;
+	u64 t0, frames, queued;
+	u32 pos;
 
         /* get the current hardware pointer */
-        return (snd_pcm_uframes_t) current_ptr;
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		/* never report frames the loopback has not written yet */
+		t0 = local_clock();
+		mychip_loopback_fill(dpcm);
+		mychip_stats_copy(st, t0);
+		frames = dpcm->loop_filled;
+	} else {
+		/* a frame counts as played once it is in the mix */
+		spin_lock_irqsave(&chip->lock, flags);
+		mychip_mix_run(chip);
+		frames = dpcm->mixed;
+
+		/*
+		 * Mixed but not yet on the link: whatever the backend still
+		 * queues (for sim, the prefilled FIFO and partial bursts),
+		 * at the stream rate, plus the SRC group delay.
+		 */
+		if (!list_empty(&dpcm->list)) {
+			queued = chip->mix_pos - chip->backend->link_pos(chip);
+			delay = div64_u64(queued * dpcm->rate, chip->mix_rate);
+		}
+		if (dpcm->src_coeffs)
+			delay += dpcm->src_taps / 2;
+		spin_unlock_irqrestore(&chip->lock, flags);
+	}
+	/* wall_clock follows right after, it must report this very frame */
+	dpcm->ptr_frames = frames;
+	div_u64_rem(frames, dpcm->buffer_size, &pos);
+
+	spin_lock_irqsave(&st->lock, flags);
+	step = (pos + dpcm->buffer_size - st->ptr_last) % dpcm->buffer_size;
+	if (step && (!st->ptr_step_min || step < st->ptr_step_min))
+		st->ptr_step_min = step;
+	st->ptr_last = pos;
+	st->ptr_calls++;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	substream->runtime->delay = delay;
+
+        return (snd_pcm_uframes_t) pos;
+}
+
+/*
+ * wall_clock callback: link time of the frame at the hardware pointer,
+ * reported with the pointer as audio_tstamp. The core calls it right
+ * after .pointer under the same stream lock, so it returns the frame
+ * count .pointer sampled rather than taking a fresh one.
+ */
+static int snd_mychip_pcm_wall_clock(struct snd_pcm_substream *substream,
+				     struct timespec *audio_ts)
+{
+	struct mychip_pcm *dpcm = substream->runtime->private_data;
+
+	*audio_ts = ns_to_timespec(mychip_frames_to_ns(dpcm->ptr_frames,
+						       dpcm->rate));
+	return 0;
+}
+
+/*
+ * copy callback: the core hands us a span that never wraps the buffer,
+ * so a whole period (or more) goes into the DMA area in one bulk copy.
+ * mmap clients bypass this entirely and write the DMA area in place.
+ */
+static int snd_i2s_pcm_copy(struct snd_pcm_substream *substream, int channel,
+			    snd_pcm_uframes_t pos, void __user *buf,
+			    snd_pcm_uframes_t count)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct mychip_pcm *dpcm = runtime->private_data;
+	u64 t0 = local_clock();
+
+	if (copy_from_user(runtime->dma_area + frames_to_bytes(runtime, pos),
+			   buf, frames_to_bytes(runtime, count)))
+		return -EFAULT;
+
+	mychip_stats_copy(dpcm->stats, t0);
+	return 0;
+}
+
+/* silence callback: fill a span of the DMA area with format silence */
+static int snd_i2s_pcm_silence(struct snd_pcm_substream *substream,
+			       int channel, snd_pcm_uframes_t pos,
+			       snd_pcm_uframes_t count)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	return snd_pcm_format_set_silence(runtime->format,
+			runtime->dma_area + frames_to_bytes(runtime, pos),
+			count * runtime->channels);
 }
 
 /* operators */
@@ -185,12 +2211,36 @@ static struct snd_pcm_ops snd_mychip_playback_ops = {
         .prepare =     snd_mychip_pcm_prepare,
         .trigger =     snd_mychip_pcm_trigger,
         .pointer =     snd_mychip_pcm_pointer,
-        .prepare =     snd_i2s_pcm_prepare,
+        .wall_clock =  snd_mychip_pcm_wall_clock,
 
         // copy from user efficiently
         .copy =        snd_i2s_pcm_copy,
+        .silence =     snd_i2s_pcm_silence,
+};
+
+/* operators */
+static struct snd_pcm_ops snd_mychip_capture_ops = {
+        .open =        snd_mychip_capture_open,
+        .close =       snd_mychip_capture_close,
+        .ioctl =       snd_pcm_lib_ioctl,
+        .hw_params =   snd_mychip_pcm_hw_params,
+        .hw_free =     snd_mychip_pcm_hw_free,
+        .prepare =     snd_mychip_pcm_prepare,
+        .trigger =     snd_mychip_pcm_trigger,
+        .pointer =     snd_mychip_pcm_pointer,
+        .wall_clock =  snd_mychip_pcm_wall_clock,
 };
 
+/* preallocate every substream buffer once, at the largest size we allow */
+static int snd_mychip_preallocate(struct snd_pcm *pcm)
+{
+	return snd_pcm_lib_preallocate_pages_for_all(pcm,
+			SNDRV_DMA_TYPE_CONTINUOUS,
+			snd_dma_continuous_data(GFP_KERNEL),
+			snd_mychip_playback_hw.buffer_bytes_max,
+			snd_mychip_playback_hw.buffer_bytes_max);
+}
+
 static int snd_mychip_pcm_new(struct mychip *mychip, int device,
 					int substreams)
 {
@@ -198,36 +2248,23 @@ static int snd_mychip_pcm_new(struct mychip *mychip, int device,
 	struct snd_pcm_ops *ops;
 	int err;
 
+	/* N playback inputs to the mixer, one capture of its output */
 	err = snd_pcm_new(mychip->card, "LinkIt 7688 PCM", device,
-			       substreams, substreams, &pcm);
+			       substreams, 1, &pcm);
 	if (err < 0)
 		return err;
 	mychip->pcm = pcm;
 	ops = &snd_mychip_playback_ops;
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, ops);
+	/* capture is a loopback of what the playback side plays */
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_mychip_capture_ops);
 	pcm->private_data = mychip;
 	pcm->info_flags = 0;
 	strcpy(pcm->name, "LinkIt 7688 PCM I2S");
 
-	return 0;
+	return snd_mychip_preallocate(pcm);
 }
 
-/* operators */
-static struct snd_pcm_ops snd_mychip_capture_ops = {
-        .open =        snd_mychip_capture_open,
-        .close =       snd_mychip_capture_close,
-        .ioctl =       snd_pcm_lib_ioctl,
-        .hw_params =   snd_mychip_pcm_hw_params,
-        .hw_free =     snd_mychip_pcm_hw_free,
-        .prepare =     snd_mychip_pcm_prepare,
-        .trigger =     snd_mychip_pcm_trigger,
-        .pointer =     snd_mychip_pcm_pointer,
-};
-
-/*
- *  definitions of capture are omitted here...
- */
-
 /* create a pcm device */
 static int snd_mychip_new_pcm(struct mychip *chip)
 {
@@ -246,7 +2283,276 @@ static int snd_mychip_new_pcm(struct mychip *chip)
         snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE,
                         &snd_mychip_capture_ops);
         /* pre-allocation of buffers */
-        return 0;
+        return snd_mychip_preallocate(pcm);
+}
+
+/******** Mixer controls ********/
+
+/*
+ * One control callback set for all four controls; private_value selects
+ * master (0) or per-input (1) and volume (0) or switch (2).
+ */
+#define CTL_PCM		1
+#define CTL_SWITCH	2
+
+static int *snd_mychip_ctl_ptr(struct snd_kcontrol *kcontrol,
+			       struct snd_ctl_elem_id *id)
+{
+	struct mychip *chip = snd_kcontrol_chip(kcontrol);
+	unsigned int idx = snd_ctl_get_ioffidx(kcontrol, id);
+	int which = kcontrol->private_value;
+
+	if (which & CTL_PCM)
+		return which & CTL_SWITCH ? &chip->pcm_sw[idx] :
+					    &chip->pcm_vol[idx];
+	return which & CTL_SWITCH ? &chip->master_sw : &chip->master_vol;
+}
+
+static int snd_mychip_vol_info(struct snd_kcontrol *kcontrol,
+			       struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = VOL_MAX;
+	return 0;
+}
+
+#define snd_mychip_sw_info	snd_ctl_boolean_mono_info
+
+static int snd_mychip_ctl_get(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct mychip *chip = snd_kcontrol_chip(kcontrol);
+	unsigned long flags;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	ucontrol->value.integer.value[0] =
+		*snd_mychip_ctl_ptr(kcontrol, &ucontrol->id);
+	spin_unlock_irqrestore(&chip->lock, flags);
+	return 0;
+}
+
+static int snd_mychip_ctl_put(struct snd_kcontrol *kcontrol,
+			      struct snd_ctl_elem_value *ucontrol)
+{
+	struct mychip *chip = snd_kcontrol_chip(kcontrol);
+	long val = ucontrol->value.integer.value[0];
+	unsigned long flags;
+	int *ptr;
+	int changed;
+
+	if (kcontrol->private_value & CTL_SWITCH)
+		val = !!val;
+	else if (val < 0 || val > VOL_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	ptr = snd_mychip_ctl_ptr(kcontrol, &ucontrol->id);
+	changed = *ptr != val;
+	*ptr = val;
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	return changed;
+}
+
+#define MYCHIP_VOLUME(xname, xwhich) \
+{ .iface = SNDRV_CTL_ELEM_IFACE_MIXER, .name = xname, \
+  .access = SNDRV_CTL_ELEM_ACCESS_READWRITE | \
+	    SNDRV_CTL_ELEM_ACCESS_TLV_READ, \
+  .info = snd_mychip_vol_info, \
+  .get = snd_mychip_ctl_get, .put = snd_mychip_ctl_put, \
+  .private_value = xwhich, .tlv = { .p = mychip_db_scale } }
+
+#define MYCHIP_SWITCH(xname, xwhich) \
+{ .iface = SNDRV_CTL_ELEM_IFACE_MIXER, .name = xname, \
+  .info = snd_mychip_sw_info, \
+  .get = snd_mychip_ctl_get, .put = snd_mychip_ctl_put, \
+  .private_value = xwhich | CTL_SWITCH }
+
+static struct snd_kcontrol_new snd_mychip_controls[] = {
+	MYCHIP_VOLUME("Master Playback Volume", 0),
+	MYCHIP_SWITCH("Master Playback Switch", 0),
+	MYCHIP_VOLUME("PCM Playback Volume", CTL_PCM),
+	MYCHIP_SWITCH("PCM Playback Switch", CTL_PCM),
+};
+
+static int snd_mychip_mixer_new(struct mychip *chip, int inputs)
+{
+	struct snd_kcontrol_new tmpl;
+	struct snd_kcontrol *kctl;
+	int i, err;
+
+	chip->master_vol = VOL_MAX;
+	chip->master_sw = 1;
+	for (i = 0; i < MIX_MAX_INPUTS; i++) {
+		chip->pcm_vol[i] = VOL_MAX;
+		chip->pcm_sw[i] = 1;
+	}
+
+	strcpy(chip->card->mixername, "LinkIt 7688 Mixer");
+
+	for (i = 0; i < ARRAY_SIZE(snd_mychip_controls); i++) {
+		tmpl = snd_mychip_controls[i];
+		/* per-input controls get one element per playback substream */
+		if (tmpl.private_value & CTL_PCM)
+			tmpl.count = inputs;
+		kctl = snd_ctl_new1(&tmpl, chip);
+		if (!kctl)
+			return -ENOMEM;
+		err = snd_ctl_add(chip->card, kctl);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * /proc/asound/cardN/mixer: software mixer cost. ns_last/max/avg are per
+ * run, at most MIX_FRAMES each; ns_per_period scales the average to the
+ * shortest input period, the interval the mixer has to keep up with.
+ */
+static void snd_mychip_mixer_proc_read(struct snd_info_entry *entry,
+				       struct snd_info_buffer *buffer)
+{
+	struct mychip *chip = entry->private_data;
+	unsigned long flags;
+	u64 runs, frames, total, max, last, ticks, tick_periods, period;
+
+	spin_lock_irqsave(&chip->lock, flags);
+	ticks = chip->ticks;
+	tick_periods = chip->tick_periods;
+	runs = chip->mix_runs;
+	frames = chip->mix_frames;
+	total = chip->mix_ns_total;
+	max = chip->mix_ns_max;
+	last = chip->mix_ns_last;
+	period = chip->mix_period;
+	spin_unlock_irqrestore(&chip->lock, flags);
+
+	snd_iprintf(buffer, "rate: %u\n", chip->mix_rate);
+	snd_iprintf(buffer, "runs: %llu\n", runs);
+	snd_iprintf(buffer, "frames: %llu\n", frames);
+	snd_iprintf(buffer, "ns_last: %llu\n", last);
+	snd_iprintf(buffer, "ns_max: %llu\n", max);
+	snd_iprintf(buffer, "ns_avg: %llu\n", runs ? div64_u64(total, runs) : 0);
+	snd_iprintf(buffer, "period_frames: %llu\n", period);
+	snd_iprintf(buffer, "ns_per_period: %llu\n",
+		    frames ? div64_u64(total * period, frames) : 0);
+	snd_iprintf(buffer, "timer_ticks: %llu\n", ticks);
+	snd_iprintf(buffer, "periods_per_100_ticks: %llu\n",
+		    ticks ? div64_u64(tick_periods * 100, ticks) : 0);
+}
+
+/* /proc/asound/cardN/src: rate converter cost and latency per input */
+static void snd_mychip_src_proc_read(struct snd_info_entry *entry,
+				     struct snd_info_buffer *buffer)
+{
+	struct mychip *chip = entry->private_data;
+	unsigned long flags;
+	u64 ns, frames, latency;
+	int i;
+
+	snd_iprintf(buffer, "quality: %d\n", src_quality);
+	snd_iprintf(buffer, "%-6s %14s %14s %12s\n",
+		    "input", "frames", "ns_per_frame", "latency_ns");
+	for (i = 0; i < chip->pcm->streams[SNDRV_PCM_STREAM_PLAYBACK].substream_count; i++) {
+		spin_lock_irqsave(&chip->lock, flags);
+		ns = chip->src_ns[i];
+		frames = chip->src_frames[i];
+		latency = chip->src_latency_ns[i];
+		spin_unlock_irqrestore(&chip->lock, flags);
+
+		snd_iprintf(buffer, "%-6d %14llu %14llu %12llu\n", i, frames,
+			    frames ? div64_u64(ns, frames) : 0, latency);
+	}
+}
+
+static void snd_mychip_backend_proc_read(struct snd_info_entry *entry,
+					 struct snd_info_buffer *buffer)
+{
+	struct mychip *chip = entry->private_data;
+	unsigned long flags;
+
+	snd_iprintf(buffer, "backend:         %s\n", chip->backend->name);
+	spin_lock_irqsave(&chip->lock, flags);
+	chip->backend->proc_read(chip, buffer);
+	spin_unlock_irqrestore(&chip->lock, flags);
+}
+
+static void snd_mychip_stats_proc_read(struct snd_info_entry *entry,
+				       struct snd_info_buffer *buffer)
+{
+	struct mychip_stats *st = entry->private_data, snap;
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	snap = *st;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	snd_iprintf(buffer, "periods:         %llu\n", snap.periods);
+	snd_iprintf(buffer, "xruns:           %llu\n", snap.xruns);
+	snd_iprintf(buffer, "wakeup max ns:   %llu\n", snap.wake_ns_max);
+	snd_iprintf(buffer, "wakeup avg ns:   %llu\n", snap.periods ?
+		    div64_u64(snap.wake_ns_total, snap.periods) : 0);
+	snd_iprintf(buffer, "pointer calls:   %llu\n", snap.ptr_calls);
+	snd_iprintf(buffer, "pointer step:    %lu frames\n",
+		    (unsigned long)snap.ptr_step_min);
+	snd_iprintf(buffer, "copy ns/period:  %llu\n", snap.periods ?
+		    div64_u64(snap.copy_ns_total, snap.periods) : 0);
+	snd_iprintf(buffer, "copy max ns:     %llu\n", snap.copy_ns_max);
+	snd_iprintf(buffer, "copy calls:      %llu\n", snap.copy_calls);
+	snd_iprintf(buffer, "hw_params ns:    %llu (max %llu)\n",
+		    snap.hw_params_ns_last, snap.hw_params_ns_max);
+	snd_iprintf(buffer, "hw_params to first period ns: %llu (max %llu)\n",
+		    snap.first_period_ns_last, snap.first_period_ns_max);
+}
+
+/* any write resets the counters */
+static void snd_mychip_stats_proc_write(struct snd_info_entry *entry,
+					struct snd_info_buffer *buffer)
+{
+	struct mychip_stats *st = entry->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	memset(&st->periods, 0,
+	       sizeof(*st) - offsetof(struct mychip_stats, periods));
+	spin_unlock_irqrestore(&st->lock, flags);
+}
+
+/* stats-p<N> for each playback substream, stats-c<N> for capture */
+static void snd_mychip_stats_new(struct mychip *chip)
+{
+	struct snd_info_entry *entry;
+	char name[16];
+	int stream, i;
+
+	for (stream = 0; stream < 2; stream++) {
+		for (i = 0; i < chip->pcm->streams[stream].substream_count; i++) {
+			spin_lock_init(&chip->stats[stream][i].lock);
+			sprintf(name, "stats-%c%d",
+				stream == SNDRV_PCM_STREAM_PLAYBACK ? 'p' : 'c', i);
+			if (snd_card_proc_new(chip->card, name, &entry))
+				continue;
+			snd_info_set_text_ops(entry, &chip->stats[stream][i],
+					      snd_mychip_stats_proc_read);
+			entry->c.text.write = snd_mychip_stats_proc_write;
+			entry->mode |= S_IWUSR;
+		}
+	}
+}
+
+static void snd_mychip_free(struct snd_card *card)
+{
+	struct mychip *mychip = card->private_data;
+
+	hrtimer_cancel(&mychip->tick);
+	tasklet_kill(&mychip->tick_tasklet);
+	if (mychip->backend_data)
+		mychip->backend->remove(mychip);
+	vfree(mychip->mix_buf);
 }
 
 /******** Platform Driver ********/
@@ -255,23 +2561,73 @@ static int snd_pi_i2s_probe(struct platform_device *devptr)
 {
 	struct mychip *mychip;
 	struct snd_card *card;
+	struct snd_info_entry *entry;
+	int dev = devptr->id < 0 ? 0 : devptr->id;	/* -1: the only port */
 	int err;
 
-	err = snd_card_create(index[devptr->id], id[devptr->id], THIS_MODULE,
+	if (dev >= SNDRV_CARDS)
+		return -ENODEV;
+
+	err = snd_card_create(index[dev], id[dev], THIS_MODULE,
 			      sizeof(struct mychip), &card);
 	if (err < 0)
 		return err;
 
 	mychip = card->private_data;
 	mychip->card = card;
+	spin_lock_init(&mychip->lock);
+	INIT_LIST_HEAD(&mychip->running);
+	INIT_LIST_HEAD(&mychip->ticking);
+	hrtimer_init(&mychip->tick, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	mychip->tick.function = mychip_tick;
+	tasklet_init(&mychip->tick_tasklet, mychip_tick_tasklet,
+		     (unsigned long)mychip);
+	card->private_free = snd_mychip_free;
+
+	mychip->mix_buf = vzalloc(MIX_FRAMES * MIX_CHANNELS * sizeof(s16));
+	if (!mychip->mix_buf) {
+		err = -ENOMEM;
+		goto __nodev;
+	}
+
+	/* only the port carrying the controller's registers has a link */
+	if (!strcmp(backend, "i2s") &&
+	    platform_get_resource(devptr, IORESOURCE_MEM, 0))
+		mychip->backend = &mychip_i2s_backend;
+	else
+		mychip->backend = &mychip_sim_backend;
+	if (strcmp(backend, mychip->backend->name))
+		printk(KERN_INFO "snd_pi_i2s: port %d has no %s link, using %s\n",
+		       dev, backend, mychip->backend->name);
+	err = mychip->backend->probe(mychip, devptr);
+	if (err < 0) {
+		printk(KERN_ERR "snd_pi_i2s: %s backend probe failed: %d\n",
+		       mychip->backend->name, err);
+		goto __nodev;
+	}
 
-        err = snd_mychip_pcm_new(mychip, 0 /* device number */, 1 /* number of streams */);
+        err = snd_mychip_pcm_new(mychip, 0 /* device number */,
+				 clamp(pcm_substreams, 1, MIX_MAX_INPUTS));
         if (err < 0)
 	    goto __nodev;
 
+	err = snd_mychip_mixer_new(mychip, clamp(pcm_substreams, 1,
+						 MIX_MAX_INPUTS));
+	if (err < 0)
+		goto __nodev;
+
+	if (!snd_card_proc_new(card, "mixer", &entry))
+		snd_info_set_text_ops(entry, mychip, snd_mychip_mixer_proc_read);
+	if (!snd_card_proc_new(card, "src", &entry))
+		snd_info_set_text_ops(entry, mychip, snd_mychip_src_proc_read);
+	snd_mychip_stats_new(mychip);
+	if (!snd_card_proc_new(card, "backend", &entry))
+		snd_info_set_text_ops(entry, mychip,
+				      snd_mychip_backend_proc_read);
+
 	strcpy(card->driver, "LinkIt 7688 PCM");
 	strcpy(card->shortname, "LinkIt 7688 I2S");
-	sprintf(card->longname, "LinkIt I2S PCM Driver %i", devptr->id);
+	sprintf(card->longname, "LinkIt I2S PCM Driver %i", dev);
 
 	snd_card_set_dev(card, &devptr->dev);
 
@@ -302,9 +2658,27 @@ static struct platform_driver snd_pi_i2s_driver = {
     },
 };
 
+/* the rates SNDRV_PCM_RATE_8000_192000 covers */
+static const unsigned int mychip_link_rates[] = {
+	8000, 11025, 16000, 22050, 32000, 44100, 48000,
+	64000, 88200, 96000, 176400, 192000,
+};
+
 static int __init alsa_card_pi_i2s_init(void)
 {
 	int  cards, err = 1;
+	int i;
+
+	if (link_rate) {
+		for (i = 0; i < ARRAY_SIZE(mychip_link_rates); i++)
+			if (link_rate == mychip_link_rates[i])
+				break;
+		if (i == ARRAY_SIZE(mychip_link_rates)) {
+			printk(KERN_ERR "snd_pi_i2s: unsupported link_rate %d\n",
+			       link_rate);
+			return -EINVAL;
+		}
+	}
 
 	err = platform_driver_register(&snd_pi_i2s_driver);
 	if (err < 0)
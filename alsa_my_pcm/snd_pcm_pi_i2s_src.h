@@ -0,0 +1,249 @@
+/*
+ * Polyphase filter banks for the in-driver sample-rate converter.
+ *
+ * Blackman-windowed sinc, cutoff 0.45 of the input rate (the driver
+ * stretches a bank for downsampling so it follows the output), SRC_PHASES
+ * fractional-delay phases per bank, Q15 with every phase summing to
+ * 32768 (unity DC gain). Tap k of phase p weights input frame
+ * idx - taps/2 + 1 + k for an output at position idx + p/SRC_PHASES.
+ */
+
+#ifndef _SND_PCM_PI_I2S_SRC_H_
+#define _SND_PCM_PI_I2S_SRC_H_
+
+#define SRC_PHASES	32
+
+static const s16 src_coeffs_low[SRC_PHASES][8] __aligned(16) = {
+	{ 187, -1042, 2493, 29492, 2493, -1042, 187, 0 },
+	{ 160, -865, 1723, 29446, 3315, -1226, 215, 0 },
+	{ 135, -697, 1006, 29310, 4187, -1416, 244, -1 },
+	{ 112, -538, 344, 29082, 5105, -1610, 274, -1 },
+	{ 91, -390, -263, 28767, 6067, -1806, 304, -2 },
+	{ 72, -252, -813, 28364, 7069, -2003, 335, -4 },
+	{ 55, -126, -1307, 27876, 8107, -2197, 365, -5 },
+	{ 39, -12, -1746, 27312, 9176, -2388, 394, -7 },
+	{ 26, 90, -2130, 26668, 10272, -2571, 422, -9 },
+	{ 15, 181, -2461, 25951, 11390, -2744, 447, -11 },
+	{ 5, 260, -2739, 25166, 12524, -2905, 470, -13 },
+	{ -2, 327, -2967, 24318, 13668, -3051, 490, -15 },
+	{ -9, 383, -3147, 23414, 14817, -3178, 505, -17 },
+	{ -13, 429, -3281, 22455, 15964, -3283, 515, -18 },
+	{ -17, 464, -3372, 21454, 17103, -3363, 519, -20 },
+	{ -19, 490, -3423, 20410, 18228, -3415, 517, -20 },
+	{ -20, 508, -3436, 19331, 19333, -3436, 508, -20 },
+	{ -20, 517, -3415, 18228, 20410, -3423, 490, -19 },
+	{ -20, 519, -3363, 17103, 21454, -3372, 464, -17 },
+	{ -18, 515, -3283, 15964, 22455, -3281, 429, -13 },
+	{ -17, 505, -3178, 14817, 23414, -3147, 383, -9 },
+	{ -15, 490, -3051, 13668, 24318, -2967, 327, -2 },
+	{ -13, 470, -2905, 12524, 25166, -2739, 260, 5 },
+	{ -11, 447, -2744, 11390, 25951, -2461, 181, 15 },
+	{ -9, 422, -2571, 10272, 26668, -2130, 90, 26 },
+	{ -7, 394, -2388, 9176, 27312, -1746, -12, 39 },
+	{ -5, 365, -2197, 8107, 27876, -1307, -126, 55 },
+	{ -4, 335, -2003, 7069, 28364, -813, -252, 72 },
+	{ -2, 304, -1806, 6067, 28767, -263, -390, 91 },
+	{ -1, 274, -1610, 5105, 29082, 344, -538, 112 },
+	{ -1, 244, -1416, 4187, 29310, 1006, -697, 135 },
+	{ 0, 215, -1226, 3315, 29446, 1723, -865, 160 },
+};
+
+static const s16 src_coeffs_medium[SRC_PHASES][16] __aligned(16) = {
+	{ 18, -110, 359, -843, 1561, -2371, 3025, 29490,
+	  3025, -2371, 1561, -843, 359, -110, 18, 0 },
+	{ 17, -108, 347, -795, 1421, -2025, 2117, 29452,
+	  3974, -2714, 1693, -887, 369, -111, 18, 0 },
+	{ 17, -105, 332, -742, 1276, -1679, 1252, 29332,
+	  4960, -3051, 1818, -925, 376, -110, 17, 0 },
+	{ 16, -102, 315, -686, 1128, -1335, 434, 29131,
+	  5981, -3378, 1932, -956, 380, -109, 17, 0 },
+	{ 16, -98, 297, -627, 977, -997, -336, 28853,
+	  7031, -3693, 2036, -982, 381, -106, 16, 0 },
+	{ 15, -93, 277, -566, 824, -665, -1055, 28499,
+	  8106, -3992, 2127, -999, 378, -103, 15, 0 },
+	{ 14, -87, 256, -503, 672, -343, -1721, 28067,
+	  9203, -4273, 2204, -1009, 372, -97, 13, 0 },
+	{ 13, -82, 234, -439, 522, -34, -2334, 27565,
+	  10317, -4531, 2266, -1011, 362, -91, 11, 0 },
+	{ 12, -76, 211, -375, 374, 262, -2891, 26992,
+	  11444, -4765, 2311, -1004, 348, -83, 8, 0 },
+	{ 10, -69, 188, -311, 229, 543, -3394, 26350,
+	  12577, -4970, 2339, -987, 330, -73, 6, 0 },
+	{ 9, -63, 165, -248, 90, 807, -3840, 25646,
+	  13712, -5144, 2348, -962, 308, -62, 2, 0 },
+	{ 8, -56, 142, -186, -44, 1052, -4231, 24877,
+	  14845, -5283, 2338, -926, 282, -50, -1, 1 },
+	{ 7, -50, 119, -126, -171, 1277, -4566, 24057,
+	  15970, -5386, 2307, -881, 251, -36, -5, 1 },
+	{ 6, -44, 96, -68, -291, 1482, -4846, 23182,
+	  17081, -5448, 2255, -825, 217, -21, -10, 2 },
+	{ 5, -37, 74, -12, -403, 1666, -5072, 22257,
+	  18174, -5467, 2182, -760, 178, -4, -15, 2 },
+	{ 4, -31, 53, 41, -506, 1828, -5246, 21289,
+	  19243, -5441, 2086, -685, 136, 14, -20, 3 },
+	{ 3, -25, 33, 90, -600, 1968, -5368, 20283,
+	  20283, -5368, 1968, -600, 90, 33, -25, 3 },
+	{ 3, -20, 14, 136, -685, 2086, -5441, 19243,
+	  21289, -5246, 1828, -506, 41, 53, -31, 4 },
+	{ 2, -15, -4, 178, -760, 2182, -5467, 18174,
+	  22257, -5072, 1666, -403, -12, 74, -37, 5 },
+	{ 2, -10, -21, 217, -825, 2255, -5448, 17081,
+	  23182, -4846, 1482, -291, -68, 96, -44, 6 },
+	{ 1, -5, -36, 251, -881, 2307, -5386, 15970,
+	  24057, -4566, 1277, -171, -126, 119, -50, 7 },
+	{ 1, -1, -50, 282, -926, 2338, -5283, 14845,
+	  24877, -4231, 1052, -44, -186, 142, -56, 8 },
+	{ 0, 2, -62, 308, -962, 2348, -5144, 13712,
+	  25646, -3840, 807, 90, -248, 165, -63, 9 },
+	{ 0, 6, -73, 330, -987, 2339, -4970, 12577,
+	  26350, -3394, 543, 229, -311, 188, -69, 10 },
+	{ 0, 8, -83, 348, -1004, 2311, -4765, 11444,
+	  26992, -2891, 262, 374, -375, 211, -76, 12 },
+	{ 0, 11, -91, 362, -1011, 2266, -4531, 10317,
+	  27565, -2334, -34, 522, -439, 234, -82, 13 },
+	{ 0, 13, -97, 372, -1009, 2204, -4273, 9203,
+	  28067, -1721, -343, 672, -503, 256, -87, 14 },
+	{ 0, 15, -103, 378, -999, 2127, -3992, 8106,
+	  28499, -1055, -665, 824, -566, 277, -93, 15 },
+	{ 0, 16, -106, 381, -982, 2036, -3693, 7031,
+	  28853, -336, -997, 977, -627, 297, -98, 16 },
+	{ 0, 17, -109, 380, -956, 1932, -3378, 5981,
+	  29131, 434, -1335, 1128, -686, 315, -102, 16 },
+	{ 0, 17, -110, 376, -925, 1818, -3051, 4960,
+	  29332, 1252, -1679, 1276, -742, 332, -105, 17 },
+	{ 0, 18, -111, 369, -887, 1693, -2714, 3974,
+	  29452, 2117, -2025, 1421, -795, 347, -108, 17 },
+};
+
+static const s16 src_coeffs_high[SRC_PHASES][32] __aligned(16) = {
+	{ -2, 10, -23, 34, -33, 0, 89, -261,
+	  535, -917, 1392, -1918, 2437, -2877, 3173, 29490,
+	  3173, -2877, 2437, -1918, 1392, -917, 535, -261,
+	  89, 0, -33, 34, -23, 10, -2, 0 },
+	{ -2, 10, -21, 29, -23, -16, 111, -287,
+	  560, -929, 1371, -1834, 2241, -2473, 2227, 29453,
+	  4156, -3273, 2619, -1989, 1402, -898, 504, -231,
+	  65, 16, -42, 39, -25, 11, -3, 0 },
+	{ -2, 9, -18, 24, -14, -31, 132, -311,
+	  581, -933, 1339, -1737, 2033, -2063, 1321, 29334,
+	  5172, -3656, 2784, -2046, 1402, -870, 469, -199,
+	  41, 33, -52, 43, -26, 12, -3, 0 },
+	{ -2, 8, -16, 19, -5, -45, 151, -332,
+	  596, -930, 1298, -1629, 1814, -1651, 459, 29143,
+	  6219, -4025, 2932, -2088, 1390, -836, 430, -164,
+	  15, 49, -61, 48, -28, 12, -3, 0 },
+	{ -2, 7, -14, 14, 4, -58, 169, -350,
+	  606, -920, 1247, -1511, 1587, -1240, -357, 28876,
+	  7291, -4375, 3061, -2114, 1367, -793, 385, -127,
+	  -12, 66, -70, 52, -30, 12, -3, 0 },
+	{ -2, 7, -12, 10, 12, -71, 184, -364,
+	  611, -903, 1188, -1383, 1353, -833, -1124, 28529,
+	  8385, -4702, 3169, -2124, 1332, -743, 337, -88,
+	  -39, 83, -79, 56, -31, 13, -3, 0 },
+	{ -1, 6, -10, 5, 20, -83, 198, -376,
+	  612, -879, 1121, -1248, 1115, -433, -1841, 28114,
+	  9496, -5005, 3254, -2117, 1286, -687, 285, -47,
+	  -67, 100, -88, 60, -32, 13, -3, 0 },
+	{ -1, 5, -7, 0, 28, -93, 209, -384,
+	  607, -848, 1047, -1106, 874, -43, -2505, 27626,
+	  10620, -5279, 3316, -2093, 1229, -623, 229, -5,
+	  -95, 116, -96, 63, -33, 13, -3, 0 },
+	{ -1, 4, -5, -4, 35, -103, 219, -388,
+	  598, -812, 966, -959, 633, 336, -3115, 27068,
+	  11753, -5521, 3352, -2051, 1160, -553, 170, 39,
+	  -123, 132, -104, 66, -34, 13, -3, 0 },
+	{ -1, 3, -3, -8, 42, -111, 227, -390,
+	  584, -770, 879, -808, 393, 699, -3670, 26448,
+	  12888, -5728, 3363, -1993, 1080, -476, 108, 83,
+	  -151, 147, -111, 68, -34, 13, -3, 0 },
+	{ -1, 3, -1, -12, 48, -118, 233, -388,
+	  566, -723, 788, -654, 156, 1046, -4169, 25758,
+	  14023, -5898, 3348, -1916, 990, -394, 44, 127,
+	  -178, 162, -117, 70, -35, 13, -3, 0 },
+	{ -1, 2, 1, -15, 53, -125, 236, -384,
+	  544, -671, 692, -498, -77, 1374, -4612, 25017,
+	  15150, -6027, 3305, -1823, 890, -307, -22, 172,
+	  -205, 175, -123, 72, -34, 12, -3, 0 },
+	{ 0, 1, 2, -19, 58, -129, 238, -376,
+	  518, -616, 593, -342, -303, 1681, -4997, 24214,
+	  16267, -6113, 3234, -1712, 780, -216, -90, 216,
+	  -231, 188, -127, 73, -34, 12, -2, 0 },
+	{ 0, 1, 4, -22, 62, -133, 238, -366,
+	  489, -557, 492, -187, -521, 1966, -5326, 23358,
+	  17367, -6153, 3135, -1585, 662, -121, -158, 260,
+	  -255, 200, -131, 73, -33, 11, -2, 0 },
+	{ 0, 0, 6, -24, 65, -136, 236, -353,
+	  457, -494, 389, -34, -729, 2226, -5599, 22456,
+	  18447, -6146, 3008, -1442, 535, -22, -227, 303,
+	  -279, 210, -134, 73, -32, 10, -2, 0 },
+	{ 0, 0, 7, -27, 68, -137, 232, -337,
+	  422, -430, 285, 116, -927, 2462, -5816, 21507,
+	  19500, -6088, 2853, -1284, 402, 79, -295, 344,
+	  -300, 219, -136, 72, -31, 9, -1, 0 },
+	{ 0, -1, 8, -29, 70, -137, 226, -320,
+	  384, -363, 181, 262, -1112, 2671, -5979, 20523,
+	  20523, -5979, 2671, -1112, 262, 181, -363, 384,
+	  -320, 226, -137, 70, -29, 8, -1, 0 },
+	{ 0, -1, 9, -31, 72, -136, 219, -300,
+	  344, -295, 79, 402, -1284, 2853, -6088, 19500,
+	  21507, -5816, 2462, -927, 116, 285, -430, 422,
+	  -337, 232, -137, 68, -27, 7, 0, 0 },
+	{ 0, -2, 10, -32, 73, -134, 210, -279,
+	  303, -227, -22, 535, -1442, 3008, -6146, 18447,
+	  22456, -5599, 2226, -729, -34, 389, -494, 457,
+	  -353, 236, -136, 65, -24, 6, 0, 0 },
+	{ 0, -2, 11, -33, 73, -131, 200, -255,
+	  260, -158, -121, 662, -1585, 3135, -6153, 17367,
+	  23358, -5326, 1966, -521, -187, 492, -557, 489,
+	  -366, 238, -133, 62, -22, 4, 1, 0 },
+	{ 0, -2, 12, -34, 73, -127, 188, -231,
+	  216, -90, -216, 780, -1712, 3234, -6113, 16267,
+	  24214, -4997, 1681, -303, -342, 593, -616, 518,
+	  -376, 238, -129, 58, -19, 2, 1, 0 },
+	{ 0, -3, 12, -34, 72, -123, 175, -205,
+	  172, -22, -307, 890, -1823, 3305, -6027, 15150,
+	  25017, -4612, 1374, -77, -498, 692, -671, 544,
+	  -384, 236, -125, 53, -15, 1, 2, -1 },
+	{ 0, -3, 13, -35, 70, -117, 162, -178,
+	  127, 44, -394, 990, -1916, 3348, -5898, 14023,
+	  25758, -4169, 1046, 156, -654, 788, -723, 566,
+	  -388, 233, -118, 48, -12, -1, 3, -1 },
+	{ 0, -3, 13, -34, 68, -111, 147, -151,
+	  83, 108, -476, 1080, -1993, 3363, -5728, 12888,
+	  26448, -3670, 699, 393, -808, 879, -770, 584,
+	  -390, 227, -111, 42, -8, -3, 3, -1 },
+	{ 0, -3, 13, -34, 66, -104, 132, -123,
+	  39, 170, -553, 1160, -2051, 3352, -5521, 11753,
+	  27068, -3115, 336, 633, -959, 966, -812, 598,
+	  -388, 219, -103, 35, -4, -5, 4, -1 },
+	{ 0, -3, 13, -33, 63, -96, 116, -95,
+	  -5, 229, -623, 1229, -2093, 3316, -5279, 10620,
+	  27626, -2505, -43, 874, -1106, 1047, -848, 607,
+	  -384, 209, -93, 28, 0, -7, 5, -1 },
+	{ 0, -3, 13, -32, 60, -88, 100, -67,
+	  -47, 285, -687, 1286, -2117, 3254, -5005, 9496,
+	  28114, -1841, -433, 1115, -1248, 1121, -879, 612,
+	  -376, 198, -83, 20, 5, -10, 6, -1 },
+	{ 0, -3, 13, -31, 56, -79, 83, -39,
+	  -88, 337, -743, 1332, -2124, 3169, -4702, 8385,
+	  28529, -1124, -833, 1353, -1383, 1188, -903, 611,
+	  -364, 184, -71, 12, 10, -12, 7, -2 },
+	{ 0, -3, 12, -30, 52, -70, 66, -12,
+	  -127, 385, -793, 1367, -2114, 3061, -4375, 7291,
+	  28876, -357, -1240, 1587, -1511, 1247, -920, 606,
+	  -350, 169, -58, 4, 14, -14, 7, -2 },
+	{ 0, -3, 12, -28, 48, -61, 49, 15,
+	  -164, 430, -836, 1390, -2088, 2932, -4025, 6219,
+	  29143, 459, -1651, 1814, -1629, 1298, -930, 596,
+	  -332, 151, -45, -5, 19, -16, 8, -2 },
+	{ 0, -3, 12, -26, 43, -52, 33, 41,
+	  -199, 469, -870, 1402, -2046, 2784, -3656, 5172,
+	  29334, 1321, -2063, 2033, -1737, 1339, -933, 581,
+	  -311, 132, -31, -14, 24, -18, 9, -2 },
+	{ 0, -3, 11, -25, 39, -42, 16, 65,
+	  -231, 504, -898, 1402, -1989, 2619, -3273, 4156,
+	  29453, 2227, -2473, 2241, -1834, 1371, -929, 560,
+	  -287, 111, -16, -23, 29, -21, 10, -2 },
+};
+
+#endif
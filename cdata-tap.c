@@ -0,0 +1,138 @@
+/*
+ * Drain the cdata capture tap.
+ *
+ * Compile:
+ * $ cc -o cdata-tap cdata-tap.c
+ *
+ * Usage:
+ * # echo 1 > /sys/kernel/debug/cdata-debug/tap_enable
+ * # ./cdata-tap
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <linux/types.h>
+
+#include "cdata_ioctl.h"
+
+#define TAP_PATH "/sys/kernel/debug/cdata-debug/tap"
+#define SUBBUF_PARAM "/sys/module/cdata/parameters/tap_subbuf_size"
+#define READ_SIZE 65536
+
+struct tap_cpu {
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+/* a record is at most one sub-buffer; room for a partial one plus a read */
+static size_t buf_size(void)
+{
+    unsigned long subbuf = 0;
+    FILE *f;
+
+    f = fopen(SUBBUF_PARAM, "r");
+    if (f) {
+        if (fscanf(f, "%lu", &subbuf) != 1)
+            subbuf = 0;
+        fclose(f);
+    }
+
+    return (subbuf > READ_SIZE ? subbuf : READ_SIZE) + READ_SIZE;
+}
+
+static void dump_records(int cpu, struct tap_cpu *tap)
+{
+    struct cdata_tap_hdr hdr;
+    size_t pos = 0;
+    unsigned int i;
+
+    while (tap->len - pos >= sizeof(hdr)) {
+        memcpy(&hdr, tap->buf + pos, sizeof(hdr));
+        if (tap->len - pos < sizeof(hdr) + hdr.len)
+            break;
+
+        printf("%llu cpu=%d id=%u len=%u: ",
+               (unsigned long long)hdr.timestamp, cpu, hdr.id, hdr.len);
+        for (i = 0; i < hdr.len; i++)
+            printf("%02x", (unsigned char)tap->buf[pos + sizeof(hdr) + i]);
+        printf("\n");
+
+        pos += sizeof(hdr) + hdr.len;
+    }
+
+    /* keep a partial record for the next read */
+    memmove(tap->buf, tap->buf + pos, tap->len - pos);
+    tap->len -= pos;
+}
+
+int main(void)
+{
+    struct tap_cpu *taps;
+    struct pollfd *pfds;
+    char path[128];
+    size_t size = buf_size();
+    size_t room;
+    int ncpu;
+    int nopen = 0;
+    int cpu;
+    ssize_t n;
+
+    ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    taps = calloc(ncpu, sizeof(*taps));
+    pfds = calloc(ncpu, sizeof(*pfds));
+
+    for (cpu = 0; cpu < ncpu; cpu++) {
+        /* relay only creates files for CPUs that were online */
+        snprintf(path, sizeof(path), TAP_PATH "%d", cpu);
+        taps[cpu].fd = open(path, O_RDONLY | O_NONBLOCK);
+        pfds[cpu].fd = taps[cpu].fd;
+        pfds[cpu].events = POLLIN;
+        if (taps[cpu].fd < 0) {
+            if (errno != ENOENT) {
+                perror(path);
+                return -1;
+            }
+            continue;
+        }
+        taps[cpu].buf = malloc(size);
+        if (!taps[cpu].buf) {
+            perror("malloc");
+            return -1;
+        }
+        nopen++;
+    }
+
+    if (!nopen) {
+        fprintf(stderr, "no " TAP_PATH "<cpu> files, is the tap enabled?\n");
+        return -1;
+    }
+
+    for (;;) {
+        if (poll(pfds, ncpu, 1000) < 0) {
+            perror("poll");
+            return -1;
+        }
+
+        /*
+         * relay only signals POLLIN for completed sub-buffers; drain every
+         * CPU on timeout too so a slow stream still shows up.
+         */
+        for (cpu = 0; cpu < ncpu; cpu++) {
+            if (taps[cpu].fd < 0)
+                continue;
+            room = size - taps[cpu].len;
+            n = read(taps[cpu].fd, taps[cpu].buf + taps[cpu].len,
+                     room < READ_SIZE ? room : READ_SIZE);
+            if (n <= 0)
+                continue;
+            taps[cpu].len += n;
+            dump_records(cpu, &taps[cpu]);
+        }
+    }
+}
@@ -17,6 +17,14 @@
 #include <linux/debugfs.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/atomic.h>
+#include <linux/relay.h>
+#include <linux/poll.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/hrtimer.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 
@@ -24,46 +32,464 @@
 
 #define CDATA_MAJOR 121
 #define	BUF_SIZE 8
+#define FLUSH_DELAY (10*HZ)
+
+static unsigned int buf_size = BUF_SIZE;
+module_param(buf_size, uint, S_IRUGO);
+MODULE_PARM_DESC(buf_size, "per-open device buffer size in bytes");
+
+static bool use_hugepages = true;
+module_param(use_hugepages, bool, S_IRUGO);
+MODULE_PARM_DESC(use_hugepages, "back device buffers with compound pages when possible");
 
 #ifdef __USE_FBMEM__
 #define FRAMEBUFFER_SIZE (640*480*1)
-static unsigned int framebuffer_off;
+/*
+ * Free-running byte counter; flushes reserve their region with one
+ * fetch-add and the ring position is taken modulo FRAMEBUFFER_SIZE.
+ * 64 bits wide so the counter itself never wraps.
+ */
+static atomic64_t framebuffer_off = ATOMIC64_INIT(0);
 #endif
 
 static DEFINE_MUTEX(ioctl_lock);
 static struct dentry *debugfs;
+static struct dentry *debugfs_dir;
+
+/*
+ * Lock contention statistics. Accounting is compiled in but patched out
+ * with a static key until enabled through debugfs (cdata-debug/lockstat_enable),
+ * so the disabled cost is a single no-op branch per lock operation.
+ */
+struct cdata_lock_stat {
+	const char *name;
+	atomic64_t acquired;
+	atomic64_t contended;
+	atomic64_t wait_total;	/* ns */
+	atomic64_t wait_max;	/* ns */
+	atomic64_t hold_total;	/* ns */
+	atomic64_t hold_max;	/* ns */
+};
+
+static struct static_key cdata_lockstat_key = STATIC_KEY_INIT_FALSE;
+static DEFINE_MUTEX(lockstat_enable_lock);
+static bool lockstat_enabled;
+
+static struct cdata_lock_stat write_lock_stat = { .name = "write_lock" };
+static struct cdata_lock_stat ioctl_lock_stat = { .name = "ioctl_lock" };
+static u64 ioctl_lock_acquired;	/* protected by ioctl_lock itself */
+
+/*
+ * Optional capture tap: mirrors every byte written to cdata, tagged with a
+ * timestamp and the instance id, into per-CPU relay buffers exposed as
+ * cdata-debug/tap<cpu>. The channel is created on first enable.
+ */
+static unsigned int tap_subbuf_size = 65536;
+module_param(tap_subbuf_size, uint, S_IRUGO);
+MODULE_PARM_DESC(tap_subbuf_size, "size of each relay sub-buffer for the capture tap");
+
+static unsigned int tap_n_subbufs = 16;
+module_param(tap_n_subbufs, uint, S_IRUGO);
+MODULE_PARM_DESC(tap_n_subbufs, "number of relay sub-buffers per CPU for the capture tap");
+
+/*
+ * Journal mode: a device-level circular log, preallocated at load time,
+ * that keeps every byte written across opens. Positions are byte
+ * sequence numbers; read() follows f_pos, which lseek() or
+ * IOCTL_JOURNAL_SEEK can set to any sequence still held in the log.
+ */
+static unsigned int journal_size;
+module_param(journal_size, uint, S_IRUGO);
+MODULE_PARM_DESC(journal_size, "size of the persistent journal in bytes, 0 disables it");
+
+struct cdata_journal {
+	unsigned char *buf;
+	unsigned int size;
+	int order;
+	u64 head;		/* sequence of the next byte to be written */
+	struct mutex lock;	/* writers copy up to buf_size under it */
+	wait_queue_head_t readable;
+};
+
+static struct cdata_journal journal;
+
+/*
+ * Flushes run from a dedicated per-CPU workqueue on a CPU taken from
+ * flush_cpus, preferring one on the NUMA node that holds the instance's
+ * buffer. Flushes that still end up on another node are counted in
+ * cdata-debug/numa_stat.
+ */
+static char *flush_cpus;
+module_param(flush_cpus, charp, S_IRUGO);
+MODULE_PARM_DESC(flush_cpus, "CPU list the flusher may run on (e.g. \"0-3,8\"), default all");
+
+static struct workqueue_struct *cdata_flush_wq;
+static struct cpumask cdata_flush_mask;
+static atomic64_t flush_local = ATOMIC64_INIT(0);
+static atomic64_t flush_remote = ATOMIC64_INIT(0);
+
+static struct static_key cdata_tap_key = STATIC_KEY_INIT_FALSE;
+static DEFINE_MUTEX(tap_enable_lock);
+static bool tap_enabled;
+static struct rchan *tap_chan;
+static atomic_t tap_dropped = ATOMIC_INIT(0);
+static atomic_t cdata_next_id = ATOMIC_INIT(0);
 
-void *write_framebuffer_with_timer(unsigned long);
 void write_framebuffer_with_work(struct work_struct *);
 
 struct cdata_t {
-	unsigned char buf[BUF_SIZE];
+	unsigned char *buf;
+	unsigned int buf_size;
+	int buf_order;		/* compound page order, -1 if vmalloc'ed */
 	int idx;
 	wait_queue_head_t writeable;
-	struct timer_list timer;
-	struct work_struct work;
+	struct delayed_work work;	/* flush, FLUSH_DELAY after the buffer fills */
+	int node;		/* NUMA node of the instance and its buffer */
+	int flush_cpu;
 	struct mutex write_lock;
+	u64 write_lock_acquired;
 	spinlock_t lock;
+	unsigned int id;
 #ifdef __USE_FBMEM__
 	unsigned char *iomem;
 #endif
 };
 
+static void cdata_stat_max(atomic64_t *max, u64 val)
+{
+	u64 old = atomic64_read(max);
+	u64 prev;
+
+	while (val > old) {
+		prev = atomic64_cmpxchg(max, old, val);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+/*
+ * The holder may sleep and migrate while it waits for or holds the
+ * mutex, so both ends need a clock that is monotonic across CPUs, which
+ * local_clock() is not.
+ */
+static inline u64 cdata_lock_clock(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static int cdata_lock_interruptible(struct mutex *lock,
+	struct cdata_lock_stat *stat, u64 *acquired_at)
+{
+	u64 start;
+	u64 now;
+	int ret;
+
+	if (!static_key_false(&cdata_lockstat_key))
+		return mutex_lock_interruptible(lock);
+
+	if (mutex_trylock(lock)) {
+		*acquired_at = cdata_lock_clock();
+		atomic64_inc(&stat->acquired);
+		return 0;
+	}
+
+	start = cdata_lock_clock();
+	ret = mutex_lock_interruptible(lock);
+	if (ret)
+		return ret;
+	now = cdata_lock_clock();
+
+	atomic64_inc(&stat->acquired);
+	atomic64_inc(&stat->contended);
+	atomic64_add(now - start, &stat->wait_total);
+	cdata_stat_max(&stat->wait_max, now - start);
+	*acquired_at = now;
+
+	return 0;
+}
+
+static void cdata_unlock(struct mutex *lock, struct cdata_lock_stat *stat,
+	u64 *acquired_at)
+{
+	u64 held;
+
+	/* acquired_at is 0 if accounting was off when the lock was taken */
+	if (static_key_false(&cdata_lockstat_key) && *acquired_at) {
+		held = cdata_lock_clock() - *acquired_at;
+		atomic64_add(held, &stat->hold_total);
+		cdata_stat_max(&stat->hold_max, held);
+	}
+	*acquired_at = 0;
+
+	mutex_unlock(lock);
+}
+
+static void cdata_tap(struct cdata_t *cdata, const unsigned char *data,
+	unsigned int len)
+{
+	struct cdata_tap_hdr *hdr;
+	unsigned int max = tap_subbuf_size - sizeof(*hdr);
+	unsigned int chunk;
+	unsigned long flags;
+
+	if (!static_key_false(&cdata_tap_key) || !len)
+		return;
+
+	/*
+	 * A record has to fit in one sub-buffer, so large writes go out as
+	 * several records. Every record relay cannot take counts as dropped.
+	 */
+	while (len) {
+		chunk = min(len, max);
+
+		/* reserve header and payload together so records never interleave */
+		local_irq_save(flags);
+		hdr = relay_reserve(tap_chan, sizeof(*hdr) + chunk);
+		if (hdr) {
+			hdr->timestamp = local_clock();
+			hdr->id = cdata->id;
+			hdr->len = chunk;
+			memcpy(hdr + 1, data, chunk);
+		} else {
+			atomic_inc(&tap_dropped);
+		}
+		local_irq_restore(flags);
+
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Large buffers come from a single compound allocation so that both the
+ * kernel copy path (linear map, PMD/PUD sized on x86) and an mmap'd view
+ * walk as few TLB entries as possible. Falls back to vmalloc when the
+ * size exceeds MAX_ORDER or physically contiguous memory is short.
+ */
+static unsigned char *cdata_buf_alloc(unsigned int size, int *order,
+	bool hugepages, int node)
+{
+	struct page *page;
+	int o = get_order(size);
+
+	if (hugepages && o < MAX_ORDER) {
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP |
+					__GFP_ZERO | __GFP_NOWARN |
+					__GFP_NORETRY, o);
+		if (page) {
+			*order = o;
+			return page_address(page);
+		}
+	}
+
+	*order = -1;
+	return vmalloc_user(size);
+}
+
+static void cdata_buf_free(unsigned char *buf, int order)
+{
+	if (order < 0)
+		vfree(buf);
+	else
+		__free_pages(virt_to_page(buf), order);
+}
+
+static int cdata_journal_init(void)
+{
+	if (!journal_size)
+		return 0;
+
+	journal.buf = cdata_buf_alloc(journal_size, &journal.order,
+				      use_hugepages, NUMA_NO_NODE);
+	if (!journal.buf)
+		return -ENOMEM;
+
+	journal.size = journal_size;
+	journal.head = 0;
+	mutex_init(&journal.lock);
+	init_waitqueue_head(&journal.readable);
+
+	return 0;
+}
+
+static void cdata_journal_exit(void)
+{
+	if (journal.buf)
+		cdata_buf_free(journal.buf, journal.order);
+	journal.buf = NULL;
+}
+
+/* oldest sequence still held in the log, caller holds journal.lock */
+static u64 cdata_journal_tail(void)
+{
+	return journal.head > journal.size ? journal.head - journal.size : 0;
+}
+
+static void cdata_journal_append(const unsigned char *data, unsigned int len)
+{
+	unsigned int off;
+	unsigned int first;
+	u64 head;
+
+	if (!journal.buf || !len)
+		return;
+
+	/* only the newest journal.size bytes can survive */
+	if (len > journal.size) {
+		data += len - journal.size;
+		len = journal.size;
+	}
+
+	mutex_lock(&journal.lock);
+	head = journal.head;
+	off = do_div(head, journal.size);
+	first = min(len, journal.size - off);
+	memcpy(journal.buf + off, data, first);
+	memcpy(journal.buf, data + first, len - first);
+	journal.head += len;
+	mutex_unlock(&journal.lock);
+
+	wake_up_interruptible(&journal.readable);
+}
+
+/*
+ * Copy out without holding the lock across copy_to_user, then check that
+ * the writer did not lap the region meanwhile; retry from the new tail
+ * if it did.
+ */
+static ssize_t cdata_journal_read(struct file *filp, char __user *user,
+	size_t size, loff_t *off)
+{
+	unsigned int pos;
+	unsigned int first;
+	size_t len;
+	u64 seq;
+	u64 head;
+	u64 tail;
+	int ret;
+
+retry:
+	mutex_lock(&journal.lock);
+	head = journal.head;
+	tail = cdata_journal_tail();
+	mutex_unlock(&journal.lock);
+
+	seq = max_t(u64, *off, tail);
+	if (seq >= head) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(journal.readable,
+					       ACCESS_ONCE(journal.head) > seq);
+		if (ret)
+			return ret;
+		goto retry;
+	}
+
+	len = min_t(u64, size, head - seq);
+	tail = seq;
+	pos = do_div(tail, journal.size);
+	first = min_t(size_t, len, journal.size - pos);
+
+	if (copy_to_user(user, journal.buf + pos, first) ||
+	    copy_to_user(user + first, journal.buf, len - first))
+		return -EFAULT;
+
+	mutex_lock(&journal.lock);
+	tail = cdata_journal_tail();
+	mutex_unlock(&journal.lock);
+	if (seq < tail) {
+		*off = tail;
+		goto retry;
+	}
+
+	*off = seq + len;
+
+	return len;
+}
+
+static loff_t cdata_llseek(struct file *filp, loff_t offset, int whence)
+{
+	u64 head;
+
+	if (!journal.buf)
+		return -ESPIPE;
+
+	mutex_lock(&journal.lock);
+	head = journal.head;
+	mutex_unlock(&journal.lock);
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += filp->f_pos;
+		break;
+	case SEEK_END:
+		offset += head;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (offset < 0)
+		return -EINVAL;
+
+	filp->f_pos = offset;
+
+	return offset;
+}
+
+/* a flusher CPU on node if flush_cpus has one there, else any of them */
+static int cdata_flush_cpu(int node)
+{
+	unsigned int cpu;
+
+	cpu = cpumask_any_and(cpumask_of_node(node), &cdata_flush_mask);
+	if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+		cpu = cpumask_any_and(&cdata_flush_mask, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		return WORK_CPU_UNBOUND;
+
+	return cpu;
+}
+
+static void cdata_flush_schedule(struct cdata_t *cdata)
+{
+	/* no-op while a flush is already pending */
+	queue_delayed_work_on(cdata->flush_cpu, cdata_flush_wq, &cdata->work,
+			      FLUSH_DELAY);
+}
+
 static int cdata_open(struct inode *inode, struct file *filp)
 {
 	struct cdata_t *cdata;
+	int node = numa_node_id();	/* the opener is the writer */
 
 	printk(KERN_ALERT "cdata in open: filp = %p\n", filp);
 
-	cdata = kzalloc(sizeof(*cdata), GFP_KERNEL);
+	cdata = kzalloc_node(sizeof(*cdata), GFP_KERNEL, node);
+	if (!cdata)
+		return -ENOMEM;
+
+	cdata->node = node;
+	cdata->flush_cpu = cdata_flush_cpu(node);
+	cdata->buf_size = max_t(unsigned int, buf_size, 2);
+	cdata->buf = cdata_buf_alloc(cdata->buf_size, &cdata->buf_order,
+				     use_hugepages, node);
+	if (!cdata->buf) {
+		kfree(cdata);
+		return -ENOMEM;
+	}
+
 	cdata->idx = 0;
+	cdata->id = atomic_inc_return(&cdata_next_id);
 #ifdef __USE_FBMEM__
 	cdata->iomem = ioremap(0xe0000000, FRAMEBUFFER_SIZE);
 #endif
 
 	init_waitqueue_head(&cdata->writeable);
-	init_timer(&cdata->timer);
-	INIT_WORK(&cdata->work, write_framebuffer_with_work);
+	INIT_DELAYED_WORK(&cdata->work, write_framebuffer_with_work);
 	mutex_init(&cdata->write_lock);
 	spin_lock_init(&cdata->lock);
 
@@ -78,109 +504,166 @@ static int cdata_close(struct inode *inode, struct file *filp)
 	int idx;
 	int i;
 
-	idx = cdata->idx;
+	/* buffers can be large now: only dump the first few bytes */
+	idx = min_t(int, cdata->idx, BUF_SIZE);
 
 	for (i = 0; i < idx; i++) {
 		printk(KERN_ALERT "buf[%d]: %c\n", i, cdata->buf[i]);
 	}
 
-	del_timer(&cdata->timer);
+	cancel_delayed_work_sync(&cdata->work);
+	cdata_buf_free(cdata->buf, cdata->buf_order);
 	kfree(cdata);
 	
 	return 0;
 }
 
-static ssize_t cdata_read(struct file *filp, const char __user *user, 
+static ssize_t cdata_read(struct file *filp, char __user *user,
 	size_t size, loff_t *off)
 {
+	if (journal.buf)
+		return cdata_journal_read(filp, user, size, off);
+
 	printk(KERN_ALERT "cdata in read\n");
 	return 0;
 }
 
-void write_framebuffer_with_work(struct work_struct *work)
+#ifdef __USE_FBMEM__
+/* reserve len contiguous bytes, returns the ring offset of the region */
+static unsigned int framebuffer_reserve(unsigned int len)
 {
-	struct cdata_t *cdata = container_of(work, struct cdata_t, work);
+	u64 start;
 
-	cdata->idx = 0;
-	wake_up_interruptible(&cdata->writeable);
+	start = atomic64_add_return(len, &framebuffer_off) - len;
 
-	printk(KERN_INFO "cdata: wake up process");
+	return do_div(start, FRAMEBUFFER_SIZE);
 }
 
-void *write_framebuffer_with_timer(unsigned long arg)
+/* no lock needed: each caller owns the region it reserved */
+static void framebuffer_copy(unsigned char *iomem, const unsigned char *src,
+	unsigned int len)
 {
-	struct cdata_t *cdata = (struct cdata_t *)arg;
-	int i;
+	unsigned int off;
+	unsigned int first;
+
+	/* never copy more than the ioremapped window */
+	len = min_t(unsigned int, len, FRAMEBUFFER_SIZE);
+	off = framebuffer_reserve(len);
+	first = min_t(unsigned int, len, FRAMEBUFFER_SIZE - off);
+
+	memcpy_toio(iomem + off, src, first);
+	if (first < len)
+		memcpy_toio(iomem, src + first, len - first);
+}
+#endif
+
+void write_framebuffer_with_work(struct work_struct *work)
+{
+	struct cdata_t *cdata = container_of(to_delayed_work(work),
+					     struct cdata_t, work);
 
 	printk(KERN_INFO "cdata: wake up process");
 
-#ifdef __USE_FBMEM__
-	unsigned char *iomem;
-	iomem = cdata->iomem;
+	if (cpu_to_node(raw_smp_processor_id()) == cdata->node)
+		atomic64_inc(&flush_local);
+	else
+		atomic64_inc(&flush_remote);
 
-	for (i = 0; i < BUF_SIZE - 1; i++) {
-		if (framebuffer_off >= FRAMEBUFFER_SIZE)
-			framebuffer_off = 0;
-		writeb(cdata->buf[i], iomem + framebuffer_off);
-		framebuffer_off++;
-	}
+#ifdef __USE_FBMEM__
+	framebuffer_copy(cdata->iomem, cdata->buf, cdata->idx);
 #endif
 	cdata->idx = 0;
 	wake_up_interruptible(&cdata->writeable);
 }
 
-static ssize_t cdata_write(struct file *filp, const char __user *user, 
+/*
+ * Accept as much as fits. A full buffer schedules the flush; a blocking
+ * writer then sleeps until it drains, a non-blocking one gets -EAGAIN
+ * (or the short count if it already wrote something). A signal ends the
+ * write with the bytes accepted so far, or -ERESTARTSYS if none were.
+ */
+static ssize_t cdata_write(struct file *filp, const char __user *user,
 	size_t size, loff_t *off)
 {
 	struct cdata_t *cdata = (struct cdata_t *)filp->private_data;
-	DECLARE_WAITQUEUE(wait, current);
-	struct timer_list timer;
-	int i;
+	DEFINE_WAIT(wait);
+	size_t done = 0;
+	unsigned int len;
 	int idx;
+	int ret;
 
-	mutex_lock_interruptible(&cdata->write_lock);
-	init_timer(&timer);
-	idx = cdata->idx;
+	if (cdata_lock_interruptible(&cdata->write_lock, &write_lock_stat,
+				     &cdata->write_lock_acquired))
+		return -ERESTARTSYS;
+
+	while (done < size) {
+		idx = cdata->idx;
+
+		if (idx > (cdata->buf_size - 1)) {
+			cdata_flush_schedule(cdata);
+
+			if (filp->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				goto out;
+			}
+
+			prepare_to_wait(&cdata->writeable, &wait,
+					TASK_INTERRUPTIBLE);
+			cdata_unlock(&cdata->write_lock, &write_lock_stat,
+				     &cdata->write_lock_acquired);
+
+			if (cdata->idx > (cdata->buf_size - 1))
+				schedule();
+			finish_wait(&cdata->writeable, &wait);
+
+			if (signal_pending(current))
+				return done ? done : -ERESTARTSYS;
+
+			if (cdata_lock_interruptible(&cdata->write_lock,
+					&write_lock_stat,
+					&cdata->write_lock_acquired))
+				return done ? done : -ERESTARTSYS;
+			continue;
+		}
 
-	for (i = 0; i < size; i++) {
-		if (idx > (BUF_SIZE - 1)) {
-repeat:
-			//add_wait_queue(&cdata->writeable, &wait);
-			//current->state = TASK_INTERRUPTIBLE;
-			prepare_to_wait(&cdata->writeable, &wait, TASK_INTERRUPTIBLE);
-
-			//schedule_work(&cdata->work);
-			//timer->function = write_framebuffer_with_timer;
-			//timer->data = (unsigned long)cdata;
-			//timer->expires = jiffies + 10*HZ;
-			//mod_timer(timer, jiffies + 10*HZ);
-
-			timer.function = write_framebuffer_with_timer;
-			timer.data = (unsigned long)cdata;
-			timer.expires = jiffies + 10*HZ;
-			add_timer(&timer);
-
-			mutex_unlock(&cdata->write_lock);
-
-			schedule();
-
-			remove_wait_queue(&cdata->writeable, &wait);
-			idx = cdata->idx;
-			if (idx <= (BUF_SIZE - 1))
-				break;
-			
-			printk(KERN_ALERT "race condition: idx = %d\n", idx);	
-			mutex_lock_interruptible(&cdata->write_lock);
-			goto repeat;
+		len = min_t(size_t, size - done, cdata->buf_size - idx);
+		if (copy_from_user(&cdata->buf[idx], user + done, len)) {
+			ret = -EFAULT;
+			goto out;
 		}
-		copy_from_user(&cdata->buf[idx], &user[i], 1);
-		idx++;
+
+		cdata_tap(cdata, &cdata->buf[idx], len);
+		cdata_journal_append(&cdata->buf[idx], len);
+		cdata->idx = idx + len;
+		done += len;
 	}
 
-	cdata->idx = idx;
-	mutex_unlock(&cdata->write_lock);
+	ret = 0;
+out:
+	cdata_unlock(&cdata->write_lock, &write_lock_stat,
+		     &cdata->write_lock_acquired);
 
-	return 0;
+	return done ? done : ret;
+}
+
+static unsigned int cdata_poll(struct file *filp, poll_table *wait)
+{
+	struct cdata_t *cdata = (struct cdata_t *)filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &cdata->writeable, wait);
+	if (journal.buf)
+		poll_wait(filp, &journal.readable, wait);
+
+	if (cdata->idx <= (cdata->buf_size - 1))
+		mask |= POLLOUT | POLLWRNORM;
+	else
+		cdata_flush_schedule(cdata);
+
+	if (journal.buf && ACCESS_ONCE(journal.head) > filp->f_pos)
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
 }
 
 static long cdata_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -192,8 +675,11 @@ static long cdata_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	int ret = 0;
 	char *user;
 	int size;
+	struct cdata_journal_info info;
+	__u64 seq;
 
-	if (mutex_lock_interruptible(&ioctl_lock))
+	if (cdata_lock_interruptible(&ioctl_lock, &ioctl_lock_stat,
+				     &ioctl_lock_acquired))
 		return -EINTR;
 
 	user = (char *)arg;
@@ -211,7 +697,7 @@ static long cdata_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		break;
 	case IOCTL_NAME:
 		for (i = 0; i < size; i++) {
-			if (idx > (BUF_SIZE - 1)) {
+			if (idx > (cdata->buf_size - 1)) {
 				ret = -EFAULT;
 				goto exit;
 			}
@@ -219,13 +705,38 @@ static long cdata_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			idx++;
 		}
 		break;
+	case IOCTL_JOURNAL_SEEK:
+		if (!journal.buf) {
+			ret = -ENOTTY;
+			goto exit;
+		}
+		if (copy_from_user(&seq, (void __user *)arg, sizeof(seq))) {
+			ret = -EFAULT;
+			goto exit;
+		}
+		filp->f_pos = seq;
+		break;
+	case IOCTL_JOURNAL_INFO:
+		if (!journal.buf) {
+			ret = -ENOTTY;
+			goto exit;
+		}
+		mutex_lock(&journal.lock);
+		info.head = journal.head;
+		info.tail = cdata_journal_tail();
+		mutex_unlock(&journal.lock);
+		info.size = journal.size;
+		info.pad = 0;
+		if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+			ret = -EFAULT;
+		break;
 	default:
 		goto exit;
 	}
 
 exit:
 	cdata->idx = idx;
-	mutex_unlock(&ioctl_lock);
+	cdata_unlock(&ioctl_lock, &ioctl_lock_stat, &ioctl_lock_acquired);
 	return ret;
 }
 
@@ -234,9 +745,25 @@ static int cdata_mmap(struct file *filp, struct vm_area_struct *vma)
     unsigned long start = vma->vm_start;
     unsigned long end = vma->vm_end;
     unsigned long size = end - start;
+#ifndef __USE_FBMEM__
+    struct cdata_t *cdata = (struct cdata_t *)filp->private_data;
+#endif
 
+#ifdef __USE_FBMEM__
     printk(KERN_ALERT "remap %p to 0xe0000000\n", start);
     remap_pfn_range(vma, start, 0xe0000000, size, PAGE_SHARED);
+#else
+    /* map the device buffer itself */
+    if (vma->vm_pgoff || size > PAGE_ALIGN(cdata->buf_size))
+	return -EINVAL;
+
+    if (cdata->buf_order < 0)
+	return remap_vmalloc_range(vma, cdata->buf, 0);
+
+    /* physically contiguous: one remap covers the whole compound page */
+    return remap_pfn_range(vma, start, page_to_pfn(virt_to_page(cdata->buf)),
+			   size, vma->vm_page_prot);
+#endif
 
     return 0;
 }
@@ -244,13 +771,363 @@ static int cdata_mmap(struct file *filp, struct vm_area_struct *vma)
 static struct file_operations cdata_fops = {
     owner:      	THIS_MODULE,
     open:		cdata_open,
+    llseek:		cdata_llseek,
     read:		cdata_read,
     write:		cdata_write,
+    poll:		cdata_poll,
     mmap:		cdata_mmap,
     unlocked_ioctl:	cdata_ioctl,
     release:    	cdata_close
 };
 
+static void lockstat_show_one(struct seq_file *s, struct cdata_lock_stat *stat)
+{
+	seq_printf(s, "%-12s %12lld %12lld %14lld %12lld %14lld %12lld\n",
+		   stat->name,
+		   (long long)atomic64_read(&stat->acquired),
+		   (long long)atomic64_read(&stat->contended),
+		   (long long)atomic64_read(&stat->wait_total),
+		   (long long)atomic64_read(&stat->wait_max),
+		   (long long)atomic64_read(&stat->hold_total),
+		   (long long)atomic64_read(&stat->hold_max));
+}
+
+static void lockstat_reset_one(struct cdata_lock_stat *stat)
+{
+	atomic64_set(&stat->acquired, 0);
+	atomic64_set(&stat->contended, 0);
+	atomic64_set(&stat->wait_total, 0);
+	atomic64_set(&stat->wait_max, 0);
+	atomic64_set(&stat->hold_total, 0);
+	atomic64_set(&stat->hold_max, 0);
+}
+
+static int lockstat_show(struct seq_file *s, void *unused)
+{
+	seq_printf(s, "enabled: %d\n", lockstat_enabled);
+	seq_printf(s, "%-12s %12s %12s %14s %12s %14s %12s\n",
+		   "lock", "acquired", "contended", "wait_total_ns",
+		   "wait_max_ns", "hold_total_ns", "hold_max_ns");
+	lockstat_show_one(s, &write_lock_stat);
+	lockstat_show_one(s, &ioctl_lock_stat);
+
+	return 0;
+}
+
+static int lockstat_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, lockstat_show, NULL);
+}
+
+/* any write resets the counters */
+static ssize_t lockstat_write(struct file *filp, const char __user *user,
+	size_t size, loff_t *off)
+{
+	lockstat_reset_one(&write_lock_stat);
+	lockstat_reset_one(&ioctl_lock_stat);
+
+	return size;
+}
+
+static struct file_operations lockstat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lockstat_open,
+	.read		= seq_read,
+	.write		= lockstat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int numa_stat_show(struct seq_file *s, void *unused)
+{
+	char cpus[64];
+
+	cpulist_scnprintf(cpus, sizeof(cpus), &cdata_flush_mask);
+	seq_printf(s, "flush_cpus: %s\n", cpus);
+	seq_printf(s, "flush_local: %lld\n",
+		   (long long)atomic64_read(&flush_local));
+	seq_printf(s, "flush_remote: %lld\n",
+		   (long long)atomic64_read(&flush_remote));
+
+	return 0;
+}
+
+static int numa_stat_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, numa_stat_show, NULL);
+}
+
+/* any write resets the counters */
+static ssize_t numa_stat_write(struct file *filp, const char __user *user,
+	size_t size, loff_t *off)
+{
+	atomic64_set(&flush_local, 0);
+	atomic64_set(&flush_remote, 0);
+
+	return size;
+}
+
+static struct file_operations numa_stat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= numa_stat_open,
+	.read		= seq_read,
+	.write		= numa_stat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static ssize_t bool_to_user(char __user *user, size_t size, loff_t *off,
+	bool val)
+{
+	char buf[2];
+
+	buf[0] = val ? '1' : '0';
+	buf[1] = '\n';
+
+	return simple_read_from_buffer(user, size, off, buf, 2);
+}
+
+static ssize_t lockstat_enable_read(struct file *filp, char __user *user,
+	size_t size, loff_t *off)
+{
+	return bool_to_user(user, size, off, lockstat_enabled);
+}
+
+static int bool_from_user(const char __user *user, size_t size, bool *res)
+{
+	char buf[8];
+	size_t len;
+
+	len = min(size, sizeof(buf) - 1);
+	if (copy_from_user(buf, user, len))
+		return -EFAULT;
+	buf[len] = '\0';
+
+	if (strtobool(buf, res))
+		return -EINVAL;
+
+	return 0;
+}
+
+static ssize_t lockstat_enable_write(struct file *filp,
+	const char __user *user, size_t size, loff_t *off)
+{
+	bool enable;
+	int ret;
+
+	ret = bool_from_user(user, size, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&lockstat_enable_lock);
+	if (enable && !lockstat_enabled)
+		static_key_slow_inc(&cdata_lockstat_key);
+	else if (!enable && lockstat_enabled)
+		static_key_slow_dec(&cdata_lockstat_key);
+	lockstat_enabled = enable;
+	mutex_unlock(&lockstat_enable_lock);
+
+	return size;
+}
+
+static struct file_operations lockstat_enable_fops = {
+	.owner		= THIS_MODULE,
+	.read		= lockstat_enable_read,
+	.write		= lockstat_enable_write,
+	.llseek		= default_llseek,
+};
+
+static struct dentry *tap_create_buf_file(const char *filename,
+	struct dentry *parent, umode_t mode, struct rchan_buf *buf,
+	int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int tap_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+/*
+ * Drop rather than overwrite when the reader falls behind; the failed
+ * relay_reserve() is counted in cdata_tap().
+ */
+static int tap_subbuf_start(struct rchan_buf *buf, void *subbuf,
+	void *prev_subbuf, size_t prev_padding)
+{
+	return !relay_buf_full(buf);
+}
+
+static struct rchan_callbacks tap_relay_callbacks = {
+	.subbuf_start		= tap_subbuf_start,
+	.create_buf_file	= tap_create_buf_file,
+	.remove_buf_file	= tap_remove_buf_file,
+};
+
+static ssize_t tap_enable_read(struct file *filp, char __user *user,
+	size_t size, loff_t *off)
+{
+	return bool_to_user(user, size, off, tap_enabled);
+}
+
+static ssize_t tap_enable_write(struct file *filp, const char __user *user,
+	size_t size, loff_t *off)
+{
+	bool enable;
+	int ret;
+
+	ret = bool_from_user(user, size, &enable);
+	if (ret)
+		return ret;
+
+	/* each record needs room for its header and at least one byte */
+	if (enable && tap_subbuf_size <= sizeof(struct cdata_tap_hdr))
+		return -EINVAL;
+
+	mutex_lock(&tap_enable_lock);
+	if (enable && !tap_chan) {
+		tap_chan = relay_open("tap", debugfs_dir, tap_subbuf_size,
+				      tap_n_subbufs, &tap_relay_callbacks, NULL);
+		if (!tap_chan) {
+			printk(KERN_ALERT "cdata: relay_open failed\n");
+			ret = -ENOMEM;
+			goto exit;
+		}
+	}
+
+	if (enable && !tap_enabled)
+		static_key_slow_inc(&cdata_tap_key);
+	else if (!enable && tap_enabled)
+		static_key_slow_dec(&cdata_tap_key);
+	tap_enabled = enable;
+
+exit:
+	mutex_unlock(&tap_enable_lock);
+	return ret ? ret : size;
+}
+
+static struct file_operations tap_enable_fops = {
+	.owner		= THIS_MODULE,
+	.read		= tap_enable_read,
+	.write		= tap_enable_write,
+	.llseek		= default_llseek,
+};
+
+static ssize_t tap_dropped_read(struct file *filp, char __user *user,
+	size_t size, loff_t *off)
+{
+	char buf[16];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%d\n", atomic_read(&tap_dropped));
+
+	return simple_read_from_buffer(user, size, off, buf, len);
+}
+
+static struct file_operations tap_dropped_fops = {
+	.owner		= THIS_MODULE,
+	.read		= tap_dropped_read,
+	.llseek		= default_llseek,
+};
+
+/*
+ * Copy throughput benchmark: reading cdata-debug/copy_bench copies
+ * bench_size bytes through a compound-page buffer and a vmalloc buffer,
+ * sequentially and with a page-sized stride that stresses the TLB.
+ */
+static unsigned int bench_size = 4 << 20;
+module_param(bench_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_size, "buffer size used by cdata-debug/copy_bench");
+
+#define BENCH_PASSES 16
+
+static u64 bench_mbps(u64 bytes, u64 ns)
+{
+	u64 mbps = bytes * 1000;
+
+	do_div(mbps, max_t(u64, ns, 1));
+
+	return mbps;	/* bytes/ns * 1000 == MB/s */
+}
+
+static void copy_bench_one(struct seq_file *s, const char *name,
+	unsigned char *dst, const unsigned char *src, unsigned int size)
+{
+	u64 t0, seq_ns, stride_ns;
+	unsigned int off, pass, page;
+
+	t0 = local_clock();
+	for (pass = 0; pass < BENCH_PASSES; pass++)
+		memcpy(dst, src, size);
+	seq_ns = local_clock() - t0;
+
+	t0 = local_clock();
+	for (pass = 0; pass < BENCH_PASSES; pass++)
+		for (off = 0; off < PAGE_SIZE; off += 64)
+			for (page = 0; page + off + 64 <= size; page += PAGE_SIZE)
+				memcpy(dst + page + off, src + page + off, 64);
+	stride_ns = local_clock() - t0;
+
+	seq_printf(s, "%-10s %12llu %12llu\n", name,
+		   bench_mbps((u64)size * BENCH_PASSES, seq_ns),
+		   bench_mbps((u64)size * BENCH_PASSES, stride_ns));
+}
+
+/* source and destination come from the same allocator, or a TLB miss skews it */
+static void copy_bench_case(struct seq_file *s, const char *name,
+	bool hugepages, unsigned int size)
+{
+	unsigned char *src;
+	unsigned char *dst;
+	int src_order;
+	int dst_order;
+
+	src = cdata_buf_alloc(size, &src_order, hugepages, NUMA_NO_NODE);
+	dst = cdata_buf_alloc(size, &dst_order, hugepages, NUMA_NO_NODE);
+
+	/* a compound request that fell back to vmalloc reports order < 0 */
+	if (src && dst && (!hugepages || (src_order >= 0 && dst_order >= 0))) {
+		memset(src, 0x5a, size);
+		copy_bench_one(s, name, dst, src, size);
+	} else {
+		seq_printf(s, "%-10s %12s %12s\n", name, "n/a", "n/a");
+	}
+
+	if (dst)
+		cdata_buf_free(dst, dst_order);
+	if (src)
+		cdata_buf_free(src, src_order);
+}
+
+static int copy_bench_show(struct seq_file *s, void *unused)
+{
+	unsigned int size = bench_size;
+
+	seq_printf(s, "size: %u\n", size);
+	seq_printf(s, "%-10s %12s %12s\n", "buffer", "seq_MBps", "stride_MBps");
+
+	copy_bench_case(s, "compound", true, size);
+	copy_bench_case(s, "vmalloc", false, size);
+
+	return 0;
+}
+
+static int copy_bench_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, copy_bench_show, NULL);
+}
+
+static struct file_operations copy_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= copy_bench_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static struct miscdevice cdata_miscdev = {
 	.minor	= 77,
 	.name	= "cdata-misc",
@@ -293,8 +1170,18 @@ int cdata_init_module(void)
 	int ret = 0;
 
 #ifdef __USE_FBMEM__
-	framebuffer_off = 0;
+	atomic64_set(&framebuffer_off, 0);
 #endif
+	cpumask_copy(&cdata_flush_mask, cpu_possible_mask);
+	if (flush_cpus && cpulist_parse(flush_cpus, &cdata_flush_mask)) {
+		printk(KERN_ALERT "cdata: bad flush_cpus \"%s\"\n", flush_cpus);
+		return -EINVAL;
+	}
+
+	cdata_flush_wq = alloc_workqueue("cdata_flush", 0, 0);
+	if (!cdata_flush_wq)
+		return -ENOMEM;
+
 	debugfs = debugfs_create_file("cdata", S_IRUGO, NULL, NULL, &cdata_fops);
 
 	if (IS_ERR(debugfs)) {
@@ -305,17 +1192,60 @@ int cdata_init_module(void)
 
 	printk(KERN_ALERT "cdata: debugfs created\n");
 
+	debugfs_dir = debugfs_create_dir("cdata-debug", NULL);
+	if (!IS_ERR_OR_NULL(debugfs_dir)) {
+		debugfs_create_file("lockstat", S_IRUGO | S_IWUSR,
+				    debugfs_dir, NULL, &lockstat_fops);
+		debugfs_create_file("lockstat_enable", S_IRUGO | S_IWUSR,
+				    debugfs_dir, NULL, &lockstat_enable_fops);
+		debugfs_create_file("tap_enable", S_IRUGO | S_IWUSR,
+				    debugfs_dir, NULL, &tap_enable_fops);
+		debugfs_create_file("tap_dropped", S_IRUGO,
+				    debugfs_dir, NULL, &tap_dropped_fops);
+		debugfs_create_file("copy_bench", S_IRUSR,
+				    debugfs_dir, NULL, &copy_bench_fops);
+		debugfs_create_file("numa_stat", S_IRUGO | S_IWUSR,
+				    debugfs_dir, NULL, &numa_stat_fops);
+	}
+
 	mutex_init(&ioctl_lock);
 
+	ret = cdata_journal_init();
+	if (ret < 0) {
+		printk(KERN_ALERT "cdata: journal allocation failed\n");
+		goto exit_debugfs;
+	}
+
 	ret = platform_driver_register(&cdata_plat_driver);
+	if (ret < 0)
+		goto exit_journal;
+
+	return 0;
+
+exit_journal:
+	cdata_journal_exit();
+exit_debugfs:
+	/* the files' fops point into this module, never leave them behind */
+	debugfs_remove_recursive(debugfs_dir);
+	debugfs_remove(debugfs);
 exit:
+	destroy_workqueue(cdata_flush_wq);
 	return ret;
 }
 
 void cdata_cleanup_module(void)
 {
 	platform_driver_unregister(&cdata_plat_driver);
+	cdata_journal_exit();
+	if (tap_enabled)
+		static_key_slow_dec(&cdata_tap_key);
+	if (tap_chan)
+		relay_close(tap_chan);
+	debugfs_remove_recursive(debugfs_dir);
 	debugfs_remove(debugfs);
+	destroy_workqueue(cdata_flush_wq);
+	if (lockstat_enabled)
+		static_key_slow_dec(&cdata_lockstat_key);
 }
 
 module_init(cdata_init_module);
@@ -2,9 +2,27 @@
 #define _CDATA_IOCTO_H_
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define IOCTL_EMPTY _IO(0xCE, 0)
 #define IOCTL_SYNC  _IO(0xCE, 1)
 #define IOCTL_NAME  _IOW(0xCE, 2, char *)
+#define IOCTL_JOURNAL_SEEK  _IOW(0xCE, 3, __u64)
+#define IOCTL_JOURNAL_INFO  _IOR(0xCE, 4, struct cdata_journal_info)
+
+/* journal window: sequences [tail, head) are readable */
+struct cdata_journal_info {
+	__u64 head;
+	__u64 tail;
+	__u32 size;
+	__u32 pad;
+};
+
+/* record layout of the debugfs capture tap (cdata-debug/tap<cpu>) */
+struct cdata_tap_hdr {
+	__u64 timestamp;	/* ns, local_clock() */
+	__u32 id;		/* per-open instance id */
+	__u32 len;		/* payload bytes following the header */
+};
 
 #endif